@@ -11,8 +11,17 @@
 #include "polyscope/image_scalar_artist.h"
 
 #include <array>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <charconv>
+#include <chrono>
 #include <cmath>
 #include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
 #include <random>
@@ -22,10 +31,29 @@
 #include <fstream>
 #include <algorithm>
 #include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <deque>
 #include <queue>
+#include <string_view>
+#include <thread>
 #include "Eigen/Dense"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 #include "args/args.hxx"
 #include "portable-file-dialogs.h"
 
@@ -340,366 +368,5259 @@ float adaptorF_custom_accessVector3Value(const Point &v, unsigned int ind)
     return v[ind];
 }
 
-void readOff(std::string const &filename, std::vector<Point> *points, std::vector<Normal> *normals = nullptr)
+/*
+ * Read-only memory mapping of a whole file
+ */
+class MappedFile
 {
-    // points->clear();
-    // normals->clear();
-    std::ifstream obj;
-    obj.open(filename);
-    if (obj.fail())
+public:
+    MappedFile() = default;
+    explicit MappedFile(std::string const &filename)
     {
-        return;
+        open(filename);
     }
-    std::string s;
-    int a, b, c;
-    obj >> s;
-    obj >> a;
-    obj >> b;
-    obj >> c;
-    if (s == "OFF")
+    ~MappedFile()
     {
-        float x, y, z;
-        for (int i = 0; i < a; i++)
+        close();
+    }
+    MappedFile(MappedFile const &) = delete;
+    MappedFile &operator=(MappedFile const &) = delete;
+    MappedFile(MappedFile &&other) noexcept
+    {
+        *this = std::move(other);
+    }
+    MappedFile &operator=(MappedFile &&other) noexcept
+    {
+        if (this != &other)
         {
-            obj >> x;
-            obj >> y;
-            obj >> z;
-            points->push_back(Point{
-                x,
-                y,
-                z});
+            close();
+            std::swap(m_data, other.m_data);
+            std::swap(m_size, other.m_size);
+#ifdef _WIN32
+            std::swap(m_file, other.m_file);
+            std::swap(m_mapping, other.m_mapping);
+#endif
         }
+        return *this;
     }
-    else if (s == "NOFF")
+
+    bool open(std::string const &filename)
     {
-        float x, y, z, n1, n2, n3;
-        for (int i = 0; i < a; i++)
+        close();
+#ifdef _WIN32
+        m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
         {
-            obj >> x;
-            obj >> y;
-            obj >> z;
-            obj >> n1;
-            obj >> n2;
-            obj >> n3;
-            points->push_back(Point{
-                x,
-                y,
-                z});
-            normals->push_back(Normal{
-                n1,
-                n2,
-                n3});
+            close();
+            return false;
         }
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping == nullptr)
+        {
+            close();
+            return false;
+        }
+        void *data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (data == nullptr)
+        {
+            close();
+            return false;
+        }
+        m_data = static_cast<const char *>(data);
+        m_size = (std::size_t)size.QuadPart;
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        void *data = mmap(nullptr, (std::size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED)
+            return false;
+        madvise(data, (std::size_t)st.st_size, MADV_SEQUENTIAL);
+        m_data = static_cast<const char *>(data);
+        m_size = (std::size_t)st.st_size;
+#endif
+        return true;
     }
 
-    obj.close();
-}
-void readOffobj(std::string const &filename, std::vector<Point> *points, std::vector<std::array<int,3>> *edges)
+    void close()
+    {
+#ifdef _WIN32
+        if (m_data != nullptr)
+            UnmapViewOfFile(m_data);
+        if (m_mapping != nullptr)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data != nullptr)
+            munmap(const_cast<char *>(m_data), m_size);
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    bool isOpen() const
+    {
+        return m_data != nullptr;
+    }
+    const char *data() const
+    {
+        return m_data;
+    }
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    const char *m_data = nullptr;
+    std::size_t m_size = 0;
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#endif
+};
+
+/*
+ * Minimal allocation-free tokenizer over a character range, numbers are parsed with std::from_chars
+ */
+struct TextCursor
 {
-    // points->clear();
-    // normals->clear();
-    std::ifstream obj;
-    obj.open(filename);
-    if (obj.fail())
+    const char *cur;
+    const char *end;
+
+    bool atEnd() const
     {
-        return;
+        return cur >= end;
     }
-    std::string line;
-    while(std::getline(obj,line)){
-        std::istringstream iss(line);
-        std::string type;
-        //std::getline(obj,type);
-        iss >> type;
-        
-        if(type == "v"){
-            float vx, vy, vz;
-            iss >> vx;
-            iss >> vy;
-            iss >> vz;
-            points->push_back(Point {vx, vy, vz});
-        }
-        else if(type == "f"){
-            int e0, e1, e2, vt0, vt1, vt2;
-            char c0, c1, c2;
-            iss >> e0;
-            iss >> c0;
-            iss >> vt0;
-            iss >> e1;
-            iss >> c1;
-            iss >> vt1;
-            iss >> e2;
-            iss >> c2;
-            iss >> vt2;
-            edges->push_back(std::array<int,3> {e0-1,e1-1,e2-1});
+    // skips whitespace and '#' comments
+    void skipSpace()
+    {
+        while (cur < end)
+        {
+            if (*cur == '#')
+            {
+                while (cur < end && *cur != '\n')
+                    ++cur;
+            }
+            else if (std::isspace((unsigned char)*cur))
+                ++cur;
+            else
+                break;
         }
-        
     }
-    /*std::string type;
-    float vx, vy, vz;
-    obj >> type;
-    
-    obj >> vx;
-        obj >> vy;
-        obj >> vz;
-        points->push_back(Point {vx, vy, vz});
-    
-    polyscope::warning(type);*/
+    std::string_view readWord()
+    {
+        skipSpace();
+        const char *begin = cur;
+        while (cur < end && !std::isspace((unsigned char)*cur))
+            ++cur;
+        return std::string_view(begin, cur - begin);
+    }
+    bool readFloat(float &value)
+    {
+        skipSpace();
+        if (cur < end && *cur == '+')
+            ++cur;
+        auto [ptr, ec] = std::from_chars(cur, end, value);
+        if (ptr == cur)
+            return false;
+        if (ec == std::errc::result_out_of_range)
+            value = outOfRange(cur, ptr);
+        cur = ptr;
+        return true;
+    }
+    // like strtof: +-infinity for overflow, the denormal for gradual underflow, zero only below that
+    static float outOfRange(const char *begin, const char *end)
+    {
+        double wide;
+        if (std::from_chars(begin, end, wide).ec == std::errc())
+            return (float)wide;
+        // beyond double as well: tiny if the exponent is negative or, without one, the integer part is zero
+        const bool negative = *begin == '-';
+        const char *digits = begin + negative;
+        const char *exponent = std::find_if(digits, end, [](char c)
+                                            { return c == 'e' || c == 'E'; });
+        const bool tiny = exponent != end ? exponent + 1 < end && exponent[1] == '-'
+                                          : std::find_if(digits, end, [](char c)
+                                                         { return c >= '1' && c <= '9'; }) > std::find(digits, end, '.');
+        const float magnitude = tiny ? 0.0f : std::numeric_limits<float>::infinity();
+        return negative ? -magnitude : magnitude;
+    }
+    void skipLine()
+    {
+        while (cur < end && *cur != '\n')
+            ++cur;
+    }
+    bool readInt(int &value)
+    {
+        skipSpace();
+        if (cur < end && *cur == '+')
+            ++cur;
+        auto [ptr, ec] = std::from_chars(cur, end, value);
+        if (ec != std::errc())
+            return false;
+        cur = ptr;
+        return true;
+    }
+};
 
+/*
+ * Non-owning view of a contiguous array, e.g. a section of a mapped file
+ */
+template <typename T>
+struct ArrayView
+{
+    const T *ptr = nullptr;
+    std::size_t count = 0;
 
-    obj.close();
-}
+    ArrayView() = default;
+    ArrayView(const T *ptr, std::size_t count) : ptr(ptr), count(count) {}
+    ArrayView(std::vector<T> const &v) : ptr(v.data()), count(v.size()) {}
 
-struct EuclideanDistance
-{
-    static float measure(Point const &p1, Point const &p2)
+    const T *data() const
     {
-        float dx = p1[0] - p2[0];
-        float dy = p1[1] - p2[1];
-        float dz = p1[2] - p2[2];
-        return std::sqrt(dx * dx + dy * dy + dz * dz);
+        return ptr;
+    }
+    std::size_t size() const
+    {
+        return count;
+    }
+    bool empty() const
+    {
+        return count == 0;
+    }
+    const T *begin() const
+    {
+        return ptr;
+    }
+    const T *end() const
+    {
+        return ptr + count;
+    }
+    const T &operator[](std::size_t i) const
+    {
+        return ptr[i];
     }
 };
-struct Math
+
+/*
+ * Array that either owns its elements or views them in a mapping kept alive by owner. Reading
+ * never copies; owned() copies viewed elements into owned storage first, so a mapping is never
+ * written through.
+ */
+template <typename T>
+class MappedArray
 {
-    static int fact(int n)
+public:
+    MappedArray() = default;
+    MappedArray(std::vector<T> elements) : m_owned(std::move(elements)) {}
+    // views the elements while owner keeps them alive, copies them without an owner
+    MappedArray(ArrayView<T> view, std::shared_ptr<const void> owner)
     {
-        return (n == 0) || (n == 1) ? 1 : n * fact(n - 1);
+        if (owner != nullptr)
+        {
+            m_view = view;
+            m_owner = std::move(owner);
+        }
+        else
+            m_owned.assign(view.begin(), view.end());
     }
-    static float delta(int i, int j)
+
+    const T *data() const
     {
-        return (i == j) ? 1.0 : 0.0;
+        return m_owner != nullptr ? m_view.data() : m_owned.data();
+    }
+    std::size_t size() const
+    {
+        return m_owner != nullptr ? m_view.size() : m_owned.size();
+    }
+    bool empty() const
+    {
+        return size() == 0;
+    }
+    const T *begin() const
+    {
+        return data();
+    }
+    const T *end() const
+    {
+        return data() + size();
+    }
+    const T &operator[](std::size_t i) const
+    {
+        return data()[i];
+    }
+    operator ArrayView<T>() const
+    {
+        return ArrayView<T>(data(), size());
+    }
+    // true while the elements are viewed in a mapping
+    bool mapped() const
+    {
+        return m_owner != nullptr;
+    }
+
+    std::vector<T> &owned()
+    {
+        if (m_owner != nullptr)
+        {
+            m_owned.assign(m_view.begin(), m_view.end());
+            m_view = ArrayView<T>();
+            m_owner.reset();
+        }
+        return m_owned;
     }
+
+private:
+    std::vector<T> m_owned;
+    ArrayView<T> m_view;
+    std::shared_ptr<const void> m_owner;
 };
-struct Bezier
+
+enum class CacheSection : std::uint32_t
 {
-    static float Bernstein(int m, int i, float u)
+    Positions = 1,
+    Normals = 2,
+    Faces = 3,
+    // a SpatialDataStructure snapshot: TreeSnapshotInfo, then the arrays of the built tree
+    KdTree = 4,
+    KdSplits = 5,
+    KdBoxes = 6,
+    KdX = 7,
+    KdY = 8,
+    KdZ = 9,
+    KdIndices = 10,
+};
+
+// set to false (--no-cache) to always parse the text files
+bool meshCacheEnabled = true;
+// cleared by --no-cache; caches are written to the user cache directory, never next to the sources
+bool meshCacheWrite = true;
+
+/*
+ * Versioned binary container for a source file, kept in the user cache directory as
+ * "<file name>-<hash of the absolute path><suffix>", the parsed mesh as ".cg2cache" and kd-tree
+ * snapshots as ".cg2tree".
+ * Layout: Header, one SectionEntry per section, payloads aligned to 16 bytes.
+ * A cache is only used while the source file still has the recorded size and mtime.
+ */
+class MeshCache
+{
+public:
+    static constexpr std::uint32_t version = 4;
+
+    struct Blob
     {
-        if (i < 0 || i > m)
-            return 0.0;
-        if (u == 0.0)
-            return Math::delta(i, 0);
-        if (u == 1.0)
-            return Math::delta(i, m);
-        float a = Math::fact(m) / Math::fact(i) / Math::fact(m - i) * std::pow(1 - u, m - i) * std::pow(u, i);
-        return a;
+        CacheSection tag;
+        std::uint32_t elementSize;
+        const void *data;
+        std::uint64_t count;
+    };
+    template <typename T>
+    static Blob blob(CacheSection tag, ArrayView<T> view)
+    {
+        return Blob{tag, (std::uint32_t)sizeof(T), view.data(), view.size()};
     }
-    static float Bderivative(int m, int i, float u)
+
+    // $XDG_CACHE_HOME/cg2, ~/.cache/cg2 or %LOCALAPPDATA%\cg2, cg2 in the temporary directory without them
+    static std::filesystem::path directory()
     {
-        // float a = Math::fact(m)/Math::fact(i)/Math::fact(m-i)*std::pow(1-u, m-i-1)*std::pow(u, i-1)*(i-m*u);
-        float a = m * (Bezier::Bernstein(m - 1, i - 1, u) - Bezier::Bernstein(m - 1, i, u));
-        return a;
+#ifdef _WIN32
+        if (const char *local = std::getenv("LOCALAPPDATA"); local != nullptr && *local != '\0')
+            return std::filesystem::path(local) / "cg2";
+#else
+        if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0')
+            return std::filesystem::path(xdg) / "cg2";
+        if (const char *home = std::getenv("HOME"); home != nullptr && *home != '\0')
+            return std::filesystem::path(home) / ".cache" / "cg2";
+#endif
+        std::error_code ec;
+        return std::filesystem::temp_directory_path(ec) / "cg2";
     }
-    static Point q(int m, int n, float u, float v, PointList WLS)
+
+    static std::string pathFor(std::string const &source, std::string const &suffix = ".cg2cache")
     {
-        int t = 0;
-        Point sumI{0.0, 0.0, 0.0};
-        for (int i = 0; i <= m; i++)
+        std::error_code ec;
+        std::filesystem::path absolute = std::filesystem::absolute(source, ec);
+        if (ec)
+            absolute = source;
+        // FNV-1a, so files of the same name in different directories get their own caches
+        std::uint64_t hash = 0xcbf29ce484222325ull;
+        for (char c : absolute.lexically_normal().string())
+            hash = (hash ^ (unsigned char)c) * 0x100000001b3ull;
+        char key[17];
+        std::snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+        return (directory() / (std::filesystem::path(source).filename().string() + "-" + key + suffix)).string();
+    }
+
+    bool open(std::string const &source, std::string const &suffix = ".cg2cache")
+    {
+        std::uint64_t size;
+        std::int64_t mtime;
+        if (!sourceStamp(source, size, mtime) || !m_file.open(pathFor(source, suffix)))
+            return false;
+        if (m_file.size() < sizeof(Header))
+            return fail();
+        const Header expected;
+        const Header *header = reinterpret_cast<const Header *>(m_file.data());
+        if (std::memcmp(header->magic, expected.magic, sizeof(expected.magic)) != 0 || header->byteOrder != byteOrderMark || header->version != version ||
+            header->sourceSize != size || header->sourceMtime != mtime)
+            return fail();
+        if (header->sectionCount > (m_file.size() - sizeof(Header)) / sizeof(SectionEntry))
+            return fail();
+        const SectionEntry *entries = reinterpret_cast<const SectionEntry *>(m_file.data() + sizeof(Header));
+        for (std::uint32_t i = 0; i < header->sectionCount; i++)
         {
-            Point sumJ{0.0, 0.0, 0.0};
-            for (int j = 0; j <= n; j++)
+            if (entries[i].offset % alignment != 0 || entries[i].offset > m_file.size() || entries[i].elementSize == 0 ||
+                entries[i].count > (m_file.size() - entries[i].offset) / entries[i].elementSize)
+                return fail();
+        }
+        return true;
+    }
+
+    // bytes of the mapped cache file
+    std::size_t size() const
+    {
+        return m_file.size();
+    }
+    std::uint64_t droppedFaces() const
+    {
+        return m_file.isOpen() ? reinterpret_cast<const Header *>(m_file.data())->droppedFaces : 0;
+    }
+
+    // empty view when the section is missing or stores a different element type
+    template <typename T>
+    ArrayView<T> section(CacheSection tag) const
+    {
+        if (!m_file.isOpen())
+            return {};
+        const Header *header = reinterpret_cast<const Header *>(m_file.data());
+        const SectionEntry *entries = reinterpret_cast<const SectionEntry *>(m_file.data() + sizeof(Header));
+        for (std::uint32_t i = 0; i < header->sectionCount; i++)
+        {
+            if (entries[i].tag == (std::uint32_t)tag && entries[i].elementSize == sizeof(T))
+                return ArrayView<T>(reinterpret_cast<const T *>(m_file.data() + entries[i].offset), entries[i].count);
+        }
+        return {};
+    }
+
+    // writes to a temporary file first so a crashed write never leaves a valid-looking cache,
+    // named per process and call so concurrent writers of the same cache never share one
+    static bool write(std::string const &source, std::vector<Blob> const &blobs, std::string const &suffix = ".cg2cache", std::uint64_t droppedFaces = 0)
+    {
+        Header header;
+        if (!sourceStamp(source, header.sourceSize, header.sourceMtime))
+            return false;
+        header.droppedFaces = droppedFaces;
+        header.sectionCount = (std::uint32_t)blobs.size();
+        std::vector<SectionEntry> entries(blobs.size());
+        std::uint64_t offset = align(sizeof(Header) + blobs.size() * sizeof(SectionEntry));
+        for (std::size_t i = 0; i < blobs.size(); i++)
+        {
+            entries[i] = SectionEntry{(std::uint32_t)blobs[i].tag, blobs[i].elementSize, offset, blobs[i].count};
+            offset = align(offset + blobs[i].count * blobs[i].elementSize);
+        }
+
+        const std::string path = pathFor(source, suffix);
+        std::error_code ec;
+        std::filesystem::create_directories(directory(), ec);
+        static std::atomic<unsigned int> writes{0};
+        const std::string tmpPath = path + ".tmp" + std::to_string(processId()) + "-" + std::to_string(writes++);
+        {
+            std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+            if (!out)
+                return false;
+            const char zeros[alignment] = {};
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(SectionEntry));
+            std::uint64_t written = sizeof(Header) + entries.size() * sizeof(SectionEntry);
+            for (std::size_t i = 0; i < blobs.size(); i++)
             {
-                Point sum1{Bezier::Bernstein(n, j, v) * WLS[t][0], Bezier::Bernstein(n, j, v) * WLS[t][1], Bezier::Bernstein(n, j, v) * WLS[t][2]};
-                sumJ[0] += sum1[0];
-                sumJ[1] += sum1[1];
-                sumJ[2] += sum1[2];
-                t += 1;
+                out.write(zeros, entries[i].offset - written);
+                out.write(static_cast<const char *>(blobs[i].data), blobs[i].count * blobs[i].elementSize);
+                written = entries[i].offset + blobs[i].count * blobs[i].elementSize;
             }
-            Point sum2{Bezier::Bernstein(m, i, u) * sumJ[0], Bezier::Bernstein(m, i, u) * sumJ[1], Bezier::Bernstein(m, i, u) * sumJ[2]};
-            sumI[0] += sum2[0];
-            sumI[1] += sum2[1];
-            sumI[2] += sum2[2];
+            out.write(zeros, offset - written);
+            if (!out)
+            {
+                out.close();
+                std::remove(tmpPath.c_str());
+                return false;
+            }
+        }
+        std::filesystem::rename(tmpPath, path, ec);
+        if (ec)
+            std::remove(tmpPath.c_str());
+        return !ec;
+    }
+
+    static unsigned long processId()
+    {
+#ifdef _WIN32
+        return (unsigned long)GetCurrentProcessId();
+#else
+        return (unsigned long)getpid();
+#endif
+    }
+
+private:
+    static constexpr std::uint32_t byteOrderMark = 0x01020304;
+    static constexpr std::size_t alignment = 16;
+
+    struct Header
+    {
+        char magic[8] = {'C', 'G', '2', 'C', 'A', 'C', 'H', 'E'};
+        std::uint32_t byteOrder = byteOrderMark;
+        std::uint32_t version = MeshCache::version;
+        std::uint64_t sourceSize = 0;
+        std::int64_t sourceMtime = 0;
+        std::uint32_t sectionCount = 0;
+        std::uint32_t reserved = 0;
+        // faces the reader left out of the Faces section, reported again on every cache hit
+        std::uint64_t droppedFaces = 0;
+    };
+    struct SectionEntry
+    {
+        std::uint32_t tag;
+        std::uint32_t elementSize;
+        std::uint64_t offset;
+        std::uint64_t count;
+    };
+
+    MappedFile m_file;
+
+    bool fail()
+    {
+        m_file.close();
+        return false;
+    }
+    static std::uint64_t align(std::uint64_t offset)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+    static bool sourceStamp(std::string const &source, std::uint64_t &size, std::int64_t &mtime)
+    {
+        std::error_code ec;
+        size = std::filesystem::file_size(source, ec);
+        if (ec)
+            return false;
+        auto time = std::filesystem::last_write_time(source, ec);
+        if (ec)
+            return false;
+        mtime = (std::int64_t)time.time_since_epoch().count();
+        return true;
+    }
+};
+
+/*
+ * The vertices, normals and faces stored in a file's ".cg2cache", viewed in place in the mapping
+ * and valid while this object or cache() lives. readOff and readOffobj copy them into their
+ * vectors, AssetLoader keeps them mapped together with the kd-tree stored next to them.
+ */
+class MappedMesh
+{
+public:
+    bool open(std::string const &source)
+    {
+        auto cache = std::make_shared<MeshCache>();
+        if (!cache->open(source))
+            return false;
+        m_cache = std::move(cache);
+        m_points = m_cache->section<Point>(CacheSection::Positions);
+        m_normals = m_cache->section<Normal>(CacheSection::Normals);
+        m_faces = m_cache->section<std::array<int, 3>>(CacheSection::Faces);
+        return true;
+    }
+
+    ArrayView<Point> points() const
+    {
+        return m_points;
+    }
+    // empty unless the source had normals
+    ArrayView<Normal> normals() const
+    {
+        return m_normals;
+    }
+    ArrayView<std::array<int, 3>> faces() const
+    {
+        return m_faces;
+    }
+    std::size_t size() const
+    {
+        return m_cache->size();
+    }
+    std::uint64_t droppedFaces() const
+    {
+        return m_cache->droppedFaces();
+    }
+    // the mapping itself, for the kd-tree sections and as the owner keeping views alive
+    std::shared_ptr<const MeshCache> const &cache() const
+    {
+        return m_cache;
+    }
+
+private:
+    std::shared_ptr<const MeshCache> m_cache;
+    ArrayView<Point> m_points;
+    ArrayView<Normal> m_normals;
+    ArrayView<std::array<int, 3>> m_faces;
+};
+
+// 64-bit FNV-1a over the contents of a file taken 8 bytes at a time, false if it cannot be read
+bool fileChecksum(std::string const &filename, std::uint64_t *checksum)
+{
+    MappedFile file(filename);
+    if (!file.isOpen())
+        return false;
+    const std::uint64_t prime = 0x100000001b3ull;
+    std::uint64_t hash = 0xcbf29ce484222325ull ^ file.size();
+    std::size_t i = 0;
+    for (; i + 8 <= file.size(); i += 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, file.data() + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 32;
+    }
+    for (; i < file.size(); i++)
+        hash = (hash ^ (unsigned char)file.data()[i]) * prime;
+    *checksum = hash;
+    return true;
+}
+
+/*
+ * Progress of a load running on another thread; the readers add the bytes they have parsed
+ * and stop early, without writing a cache, once cancel is set. droppedFaces counts faces left
+ * out because they referenced a vertex the file does not have.
+ */
+struct LoadProgress
+{
+    std::atomic<std::size_t> done{0};
+    std::atomic<std::size_t> total{0};
+    std::atomic<std::size_t> droppedFaces{0};
+    std::atomic<bool> cancel{false};
+    std::atomic<bool> indexing{false};
+
+    float fraction() const
+    {
+        const std::size_t t = total.load(std::memory_order_relaxed);
+        return t == 0 ? 0.0f : std::min(1.0f, (float)done.load(std::memory_order_relaxed) / (float)t);
+    }
+    bool cancelled() const
+    {
+        return cancel.load(std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Reads an OFF/NOFF file. Faces are fan-triangulated into the same layout readOffobj produces,
+ * their indices refer to the vertices of this file.
+ */
+void readOff(std::string const &filename, std::vector<Point> *points, std::vector<Normal> *normals = nullptr, std::vector<std::array<int, 3>> *faces = nullptr,
+             LoadProgress *progress = nullptr)
+{
+    if (meshCacheEnabled)
+    {
+        MappedMesh cached;
+        if (cached.open(filename))
+        {
+            if (progress != nullptr)
+            {
+                progress->total = progress->done = cached.size();
+                progress->droppedFaces += cached.droppedFaces();
+            }
+            points->insert(points->end(), cached.points().begin(), cached.points().end());
+            if (normals != nullptr)
+                normals->insert(normals->end(), cached.normals().begin(), cached.normals().end());
+            if (faces != nullptr)
+                faces->insert(faces->end(), cached.faces().begin(), cached.faces().end());
+            return;
+        }
+    }
+
+    MappedFile file(filename);
+    if (!file.isOpen())
+    {
+        return;
+    }
+    if (progress != nullptr)
+        progress->total = file.size();
+    TextCursor in{file.data(), file.data() + file.size()};
+    std::string_view s = in.readWord();
+    const bool hasNormals = s == "NOFF";
+    if (!hasNormals && s != "OFF")
+        return;
+    int a, b, c;
+    if (!in.readInt(a) || !in.readInt(b) || !in.readInt(c) || a < 0 || b < 0 || (std::size_t)a > file.size() || (std::size_t)b > file.size())
+        return;
+
+    // fill the preallocated tail in place, trimming it again if the file is truncated
+    const std::size_t pointBase = points->size();
+    points->resize(pointBase + a);
+    Point *pointOut = points->data() + pointBase;
+    Normal *normalOut = nullptr;
+    std::size_t normalBase = 0;
+    if (hasNormals && normals != nullptr)
+    {
+        normalBase = normals->size();
+        normals->resize(normalBase + a);
+        normalOut = normals->data() + normalBase;
+    }
+    int i = 0;
+    for (; i < a; i++)
+    {
+        if (progress != nullptr && (i & 0xffff) == 0)
+        {
+            progress->done = in.cur - file.data();
+            if (progress->cancelled())
+                break;
+        }
+        Point &p = pointOut[i];
+        if (!in.readFloat(p[0]) || !in.readFloat(p[1]) || !in.readFloat(p[2]))
+            break;
+        if (hasNormals)
+        {
+            Normal n;
+            if (!in.readFloat(n[0]) || !in.readFloat(n[1]) || !in.readFloat(n[2]))
+                break;
+            if (normalOut != nullptr)
+                normalOut[i] = n;
+        }
+    }
+    if (i < a)
+    {
+        points->resize(pointBase + i);
+        if (normalOut != nullptr)
+            normals->resize(normalBase + i);
+        return;
+    }
+
+    // faces are always read when the cache is written, so it is complete for later callers
+    std::vector<std::array<int, 3>> localFaces;
+    std::vector<std::array<int, 3>> *faceOut = faces != nullptr ? faces : meshCacheWrite ? &localFaces : nullptr;
+    const std::size_t faceBase = faceOut != nullptr ? faceOut->size() : 0;
+    std::size_t droppedFaces = 0;
+    bool facesComplete = true;
+    if (faceOut != nullptr)
+    {
+        faceOut->reserve(faceBase + b);
+        for (int f = 0; f < b; f++)
+        {
+            if (progress != nullptr && (f & 0xffff) == 0)
+            {
+                progress->done = in.cur - file.data();
+                if (progress->cancelled())
+                {
+                    facesComplete = false;
+                    break;
+                }
+            }
+            int n, first, prev, index;
+            if (!in.readInt(n) || n < 0)
+            {
+                facesComplete = false;
+                break;
+            }
+            bool valid = true;
+            const std::size_t polygonStart = faceOut->size();
+            for (int j = 0; j < n; j++)
+            {
+                if (!in.readInt(index))
+                {
+                    facesComplete = false;
+                    break;
+                }
+                valid = valid && index >= 0 && index < a;
+                if (j == 0)
+                    first = index;
+                else if (j >= 2)
+                    faceOut->push_back(std::array<int, 3>{first, prev, index});
+                prev = index;
+            }
+            if (!facesComplete)
+                break;
+            if (!valid)
+            {
+                droppedFaces += faceOut->size() - polygonStart;
+                faceOut->resize(polygonStart);
+            }
+            // optional per-face color
+            in.skipLine();
+        }
+    }
+
+    if (progress != nullptr)
+        progress->droppedFaces += droppedFaces;
+    // a NOFF file read without normals would leave an incomplete cache
+    if (meshCacheWrite && facesComplete && (!hasNormals || normalOut != nullptr))
+    {
+        std::vector<MeshCache::Blob> blobs{MeshCache::blob(CacheSection::Positions, ArrayView<Point>(pointOut, a)),
+                                           MeshCache::blob(CacheSection::Faces, ArrayView<std::array<int, 3>>(faceOut->data() + faceBase, faceOut->size() - faceBase))};
+        if (hasNormals)
+            blobs.push_back(MeshCache::blob(CacheSection::Normals, ArrayView<Normal>(normalOut, a)));
+        MeshCache::write(filename, blobs, ".cg2cache", droppedFaces);
+    }
+}
+
+/*
+ * Reads the vertex block of an OFF/NOFF file in fixed-size batches through a bounded buffer,
+ * so neither the file nor the whole cloud has to be held in memory at once
+ */
+class OffPointStream
+{
+public:
+    explicit OffPointStream(std::string const &filename, std::size_t bufferSize = std::size_t(1) << 20)
+        : m_in(filename, std::ios::binary), m_buffer(std::max<std::size_t>(bufferSize, 2 * maxRecordSize))
+    {
+        if (!m_in)
+            return;
+        fill();
+        TextCursor in{m_begin, m_end};
+        std::string_view s = in.readWord();
+        m_hasNormals = s == "NOFF";
+        int a, b, c;
+        if ((!m_hasNormals && s != "OFF") || !in.readInt(a) || !in.readInt(b) || !in.readInt(c) || a < 0)
+            return;
+        m_begin = in.cur;
+        m_total = (std::size_t)a;
+        m_valid = true;
+    }
+
+    bool isValid() const
+    {
+        return m_valid;
+    }
+    bool hasNormals() const
+    {
+        return m_hasNormals;
+    }
+    // vertex count announced by the header
+    std::size_t size() const
+    {
+        return m_total;
+    }
+    std::size_t consumed() const
+    {
+        return m_read;
+    }
+
+    // replaces the contents of batch (and normals) with the next maxPoints vertices, returns their number
+    std::size_t next(PointList &batch, std::vector<Normal> *normals, std::size_t maxPoints)
+    {
+        batch.clear();
+        if (normals != nullptr)
+            normals->clear();
+        if (!m_valid)
+            return 0;
+        const std::size_t n = std::min(maxPoints, m_total - m_read);
+        batch.reserve(n);
+        if (normals != nullptr && m_hasNormals)
+            normals->reserve(n);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            if (m_end - m_begin < (std::ptrdiff_t)maxRecordSize)
+                fill();
+            TextCursor in{m_begin, m_end};
+            Point p;
+            Normal nrm;
+            if (!in.readFloat(p[0]) || !in.readFloat(p[1]) || !in.readFloat(p[2]) ||
+                (m_hasNormals && (!in.readFloat(nrm[0]) || !in.readFloat(nrm[1]) || !in.readFloat(nrm[2]))))
+            {
+                m_valid = false;
+                break;
+            }
+            m_begin = in.cur;
+            batch.push_back(p);
+            if (normals != nullptr && m_hasNormals)
+                normals->push_back(nrm);
+        }
+        m_read += batch.size();
+        return batch.size();
+    }
+
+private:
+    // longest vertex record the parser has to see in one piece
+    static constexpr std::size_t maxRecordSize = 1024;
+
+    std::ifstream m_in;
+    std::vector<char> m_buffer;
+    const char *m_begin = nullptr;
+    const char *m_end = nullptr;
+    std::size_t m_total = 0;
+    std::size_t m_read = 0;
+    bool m_hasNormals = false;
+    bool m_valid = false;
+
+    // moves the unparsed tail to the front and tops the buffer up from the file
+    void fill()
+    {
+        std::size_t tail = m_end - m_begin;
+        if (tail > 0)
+            std::memmove(m_buffer.data(), m_begin, tail);
+        if (m_in)
+        {
+            m_in.read(m_buffer.data() + tail, m_buffer.size() - tail);
+            tail += (std::size_t)m_in.gcount();
+        }
+        m_begin = m_buffer.data();
+        m_end = m_buffer.data() + tail;
+    }
+};
+
+/*
+ * Reference OFF reader based on ifstream extraction, kept for benchmarking readOff
+ */
+void readOffStream(std::string const &filename, std::vector<Point> *points, std::vector<Normal> *normals = nullptr)
+{
+    // points->clear();
+    // normals->clear();
+    std::ifstream obj;
+    obj.open(filename);
+    if (obj.fail())
+    {
+        return;
+    }
+    std::string s;
+    int a, b, c;
+    obj >> s;
+    obj >> a;
+    obj >> b;
+    obj >> c;
+    if (s == "OFF")
+    {
+        float x, y, z;
+        for (int i = 0; i < a; i++)
+        {
+            obj >> x;
+            obj >> y;
+            obj >> z;
+            points->push_back(Point{
+                x,
+                y,
+                z});
+        }
+    }
+    else if (s == "NOFF")
+    {
+        float x, y, z, n1, n2, n3;
+        for (int i = 0; i < a; i++)
+        {
+            obj >> x;
+            obj >> y;
+            obj >> z;
+            obj >> n1;
+            obj >> n2;
+            obj >> n3;
+            points->push_back(Point{
+                x,
+                y,
+                z});
+            normals->push_back(Normal{
+                n1,
+                n2,
+                n3});
+        }
+    }
+
+    obj.close();
+}
+/*
+ * Vertices and faces parsed from one newline-aligned part of an OBJ file
+ */
+struct ObjChunk
+{
+    PointList points;
+    std::vector<std::array<int, 3>> faces;
+    // corners (face * 3 + corner) holding a negative OBJ index, stored relative to the chunk's first vertex
+    std::vector<std::size_t> relativeCorners;
+};
+
+/*
+ * Parses one OBJ vertex reference "v", "v/vt", "v//vn" or "v/vt/vn" and returns the 0-based position
+ * index. Negative (relative) indices are resolved against the vertices parsed so far in this chunk;
+ * relative is set so the caller can shift them by the chunk's offset later.
+ */
+inline bool readObjVertexRef(TextCursor &in, int localVertexCount, int &index, bool &relative)
+{
+    int v;
+    if (!in.readInt(v) || v == 0)
+        return false;
+    relative = v < 0;
+    index = relative ? localVertexCount + v : v - 1;
+    // texture and normal indices are not used
+    for (int slash = 0; slash < 2 && !in.atEnd() && *in.cur == '/'; slash++)
+    {
+        ++in.cur;
+        if (!in.atEnd() && (*in.cur == '-' || *in.cur == '+'))
+            ++in.cur;
+        while (!in.atEnd() && *in.cur >= '0' && *in.cur <= '9')
+            ++in.cur;
+    }
+    return in.atEnd() || std::isspace((unsigned char)*in.cur);
+}
+
+void parseObjChunk(const char *begin, const char *end, ObjChunk &chunk, LoadProgress *progress)
+{
+    const std::size_t reportInterval = std::size_t(1) << 20;
+    const char *line = begin;
+    const char *reported = begin;
+    while (line < end)
+    {
+        if (progress != nullptr && (std::size_t)(line - reported) >= reportInterval)
+        {
+            progress->done += line - reported;
+            reported = line;
+            if (progress->cancelled())
+                return;
+        }
+        const char *lineEnd = static_cast<const char *>(std::memchr(line, '\n', end - line));
+        if (lineEnd == nullptr)
+            lineEnd = end;
+        TextCursor in{line, lineEnd};
+        line = lineEnd + 1;
+
+        while (!in.atEnd() && (*in.cur == ' ' || *in.cur == '\t'))
+            ++in.cur;
+        if (lineEnd - in.cur < 2 || (in.cur[1] != ' ' && in.cur[1] != '\t'))
+            continue;
+
+        if (in.cur[0] == 'v')
+        {
+            in.cur += 2;
+            Point p;
+            if (in.readFloat(p[0]) && in.readFloat(p[1]) && in.readFloat(p[2]))
+                chunk.points.push_back(p);
+        }
+        else if (in.cur[0] == 'f')
+        {
+            // polygons are fan-triangulated around their first corner while reading
+            in.cur += 2;
+            const std::size_t faceStart = chunk.faces.size();
+            const std::size_t relativeStart = chunk.relativeCorners.size();
+            const int localCount = (int)chunk.points.size();
+            int first = 0, prev = 0, n = 0;
+            bool firstRelative = false, prevRelative = false, ok = true;
+            in.skipSpace();
+            while (!in.atEnd())
+            {
+                int index;
+                bool relative;
+                if (!readObjVertexRef(in, localCount, index, relative))
+                {
+                    ok = false;
+                    break;
+                }
+                if (n == 0)
+                {
+                    first = index;
+                    firstRelative = relative;
+                }
+                else if (n >= 2)
+                {
+                    const std::size_t corner = chunk.faces.size() * 3;
+                    chunk.faces.push_back(std::array<int, 3>{first, prev, index});
+                    if (firstRelative)
+                        chunk.relativeCorners.push_back(corner);
+                    if (prevRelative)
+                        chunk.relativeCorners.push_back(corner + 1);
+                    if (relative)
+                        chunk.relativeCorners.push_back(corner + 2);
+                }
+                prev = index;
+                prevRelative = relative;
+                n++;
+                in.skipSpace();
+            }
+            if (!ok)
+            {
+                chunk.faces.resize(faceStart);
+                chunk.relativeCorners.resize(relativeStart);
+            }
+        }
+    }
+}
+
+/*
+ * Parses the file in newline-aligned chunks on numThreads threads (0 = all cores) and
+ * concatenates the chunks in file order, so the result does not depend on the thread count
+ */
+void readOffobj(std::string const &filename, std::vector<Point> *points, std::vector<std::array<int,3>> *edges, unsigned int numThreads = 0,
+                LoadProgress *progress = nullptr)
+{
+    if (meshCacheEnabled)
+    {
+        MappedMesh cached;
+        if (cached.open(filename))
+        {
+            if (progress != nullptr)
+            {
+                progress->total = progress->done = cached.size();
+                progress->droppedFaces += cached.droppedFaces();
+            }
+            points->insert(points->end(), cached.points().begin(), cached.points().end());
+            edges->insert(edges->end(), cached.faces().begin(), cached.faces().end());
+            return;
+        }
+    }
+
+    MappedFile file(filename);
+    if (!file.isOpen())
+    {
+        return;
+    }
+    const char *data = file.data();
+    const std::size_t size = file.size();
+    if (progress != nullptr)
+        progress->total = size;
+
+    // small files are not worth a thread each
+    const std::size_t minChunkSize = std::size_t(1) << 16;
+    if (numThreads == 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t nChunks = std::max<std::size_t>(1, std::min<std::size_t>(numThreads, size / minChunkSize));
+
+    std::vector<const char *> bounds(nChunks + 1);
+    bounds[0] = data;
+    bounds[nChunks] = data + size;
+    for (std::size_t i = 1; i < nChunks; i++)
+    {
+        const char *split = std::max(bounds[i - 1], data + size / nChunks * i);
+        const char *newline = static_cast<const char *>(std::memchr(split, '\n', data + size - split));
+        bounds[i] = newline == nullptr ? data + size : newline + 1;
+    }
+
+    std::vector<ObjChunk> chunks(nChunks);
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < nChunks; i++)
+        workers.emplace_back(parseObjChunk, bounds[i], bounds[i + 1], std::ref(chunks[i]), progress);
+    parseObjChunk(bounds[0], bounds[1], chunks[0], progress);
+    for (auto &worker : workers)
+        worker.join();
+    if (progress != nullptr && progress->cancelled())
+        return;
+
+    // prefix sums give each chunk its place in the output
+    std::vector<std::size_t> pointOffset(nChunks + 1, points->size());
+    std::vector<std::size_t> faceOffset(nChunks + 1, edges->size());
+    for (std::size_t i = 0; i < nChunks; i++)
+    {
+        pointOffset[i + 1] = pointOffset[i] + chunks[i].points.size();
+        faceOffset[i + 1] = faceOffset[i] + chunks[i].faces.size();
+    }
+    points->resize(pointOffset[nChunks]);
+    edges->resize(faceOffset[nChunks]);
+    for (std::size_t i = 0; i < nChunks; i++)
+    {
+        std::copy(chunks[i].points.begin(), chunks[i].points.end(), points->begin() + pointOffset[i]);
+        std::copy(chunks[i].faces.begin(), chunks[i].faces.end(), edges->begin() + faceOffset[i]);
+        // relative indices only become absolute once the vertices of all earlier chunks are counted
+        const int vertexBase = (int)(pointOffset[i] - pointOffset[0]);
+        for (std::size_t corner : chunks[i].relativeCorners)
+            (*edges)[faceOffset[i] + corner / 3][corner % 3] += vertexBase;
+    }
+
+    // faces referring to a vertex before the first or past the last one of the file are dropped
+    const int vertexCount = (int)(pointOffset[nChunks] - pointOffset[0]);
+    auto kept = std::remove_if(edges->begin() + faceOffset[0], edges->end(), [vertexCount](std::array<int, 3> const &face)
+                               { return face[0] < 0 || face[0] >= vertexCount || face[1] < 0 || face[1] >= vertexCount || face[2] < 0 || face[2] >= vertexCount; });
+    const std::size_t droppedFaces = edges->end() - kept;
+    if (progress != nullptr)
+        progress->droppedFaces += droppedFaces;
+    edges->erase(kept, edges->end());
+
+    if (meshCacheWrite)
+    {
+        MeshCache::write(filename, {MeshCache::blob(CacheSection::Positions, ArrayView<Point>(points->data() + pointOffset[0], pointOffset[nChunks] - pointOffset[0])),
+                                    MeshCache::blob(CacheSection::Faces, ArrayView<std::array<int, 3>>(edges->data() + faceOffset[0], edges->size() - faceOffset[0]))},
+                         ".cg2cache", droppedFaces);
+    }
+}
+
+/*
+ * Reference OBJ reader based on istringstream, kept for benchmarking readOffobj
+ */
+void readOffobjStream(std::string const &filename, std::vector<Point> *points, std::vector<std::array<int,3>> *edges)
+{
+    // points->clear();
+    // normals->clear();
+    std::ifstream obj;
+    obj.open(filename);
+    if (obj.fail())
+    {
+        return;
+    }
+    std::string line;
+    while(std::getline(obj,line)){
+        std::istringstream iss(line);
+        std::string type;
+        //std::getline(obj,type);
+        iss >> type;
+        
+        if(type == "v"){
+            float vx, vy, vz;
+            iss >> vx;
+            iss >> vy;
+            iss >> vz;
+            points->push_back(Point {vx, vy, vz});
+        }
+        else if(type == "f"){
+            int e0, e1, e2, vt0, vt1, vt2;
+            char c0, c1, c2;
+            iss >> e0;
+            iss >> c0;
+            iss >> vt0;
+            iss >> e1;
+            iss >> c1;
+            iss >> vt1;
+            iss >> e2;
+            iss >> c2;
+            iss >> vt2;
+            edges->push_back(std::array<int,3> {e0-1,e1-1,e2-1});
+        }
+        
+    }
+    /*std::string type;
+    float vx, vy, vz;
+    obj >> type;
+    
+    obj >> vx;
+        obj >> vy;
+        obj >> vz;
+        points->push_back(Point {vx, vy, vz});
+    
+    polyscope::warning(type);*/
+
+
+    obj.close();
+}
+
+/*
+ * Binary little-endian PLY with per-vertex positions/normals and a face list
+ */
+namespace ply
+{
+    enum class Type
+    {
+        Invalid,
+        Int8,
+        UInt8,
+        Int16,
+        UInt16,
+        Int32,
+        UInt32,
+        Float32,
+        Float64
+    };
+
+    inline Type parseType(std::string_view name)
+    {
+        if (name == "char" || name == "int8")
+            return Type::Int8;
+        if (name == "uchar" || name == "uint8")
+            return Type::UInt8;
+        if (name == "short" || name == "int16")
+            return Type::Int16;
+        if (name == "ushort" || name == "uint16")
+            return Type::UInt16;
+        if (name == "int" || name == "int32")
+            return Type::Int32;
+        if (name == "uint" || name == "uint32")
+            return Type::UInt32;
+        if (name == "float" || name == "float32")
+            return Type::Float32;
+        if (name == "double" || name == "float64")
+            return Type::Float64;
+        return Type::Invalid;
+    }
+
+    inline std::size_t typeSize(Type type)
+    {
+        switch (type)
+        {
+        case Type::Int8:
+        case Type::UInt8:
+            return 1;
+        case Type::Int16:
+        case Type::UInt16:
+            return 2;
+        case Type::Int32:
+        case Type::UInt32:
+        case Type::Float32:
+            return 4;
+        case Type::Float64:
+            return 8;
+        default:
+            return 0;
+        }
+    }
+
+    inline bool hostIsLittleEndian()
+    {
+        const std::uint16_t probe = 1;
+        unsigned char first;
+        std::memcpy(&first, &probe, 1);
+        return first == 1;
+    }
+
+    // reads one little-endian value of the given type at p
+    inline double readValue(const char *p, Type type)
+    {
+        unsigned char bytes[8];
+        const std::size_t n = typeSize(type);
+        std::memcpy(bytes, p, n);
+        if (!hostIsLittleEndian())
+            std::reverse(bytes, bytes + n);
+        switch (type)
+        {
+        case Type::Int8:
+            return (double)(std::int8_t)bytes[0];
+        case Type::UInt8:
+            return (double)bytes[0];
+        case Type::Int16:
+        {
+            std::int16_t v;
+            std::memcpy(&v, bytes, 2);
+            return v;
+        }
+        case Type::UInt16:
+        {
+            std::uint16_t v;
+            std::memcpy(&v, bytes, 2);
+            return v;
+        }
+        case Type::Int32:
+        {
+            std::int32_t v;
+            std::memcpy(&v, bytes, 4);
+            return v;
+        }
+        case Type::UInt32:
+        {
+            std::uint32_t v;
+            std::memcpy(&v, bytes, 4);
+            return v;
+        }
+        case Type::Float32:
+        {
+            float v;
+            std::memcpy(&v, bytes, 4);
+            return v;
+        }
+        case Type::Float64:
+        {
+            double v;
+            std::memcpy(&v, bytes, 8);
+            return v;
+        }
+        default:
+            return 0.0;
+        }
+    }
+
+    // copies n bytes of 32-bit values to dst in little-endian order
+    inline void writeWords(char *dst, const void *src, std::size_t n)
+    {
+        std::memcpy(dst, src, n);
+        if (!hostIsLittleEndian())
+        {
+            for (std::size_t i = 0; i < n; i += 4)
+                std::reverse(dst + i, dst + i + 4);
+        }
+    }
+
+    struct Property
+    {
+        std::string name;
+        Type type = Type::Invalid;
+        Type countType = Type::Invalid; // list properties only
+        bool isList = false;
+    };
+
+    struct Element
+    {
+        std::string name;
+        std::size_t count = 0;
+        std::vector<Property> properties;
+
+        // byte size of one record, 0 if it contains a list
+        std::size_t stride() const
+        {
+            std::size_t size = 0;
+            for (Property const &property : properties)
+            {
+                if (property.isList)
+                    return 0;
+                size += typeSize(property.type);
+            }
+            return size;
+        }
+        int find(std::string_view name) const
+        {
+            for (std::size_t i = 0; i < properties.size(); i++)
+                if (properties[i].name == name)
+                    return (int)i;
+            return -1;
+        }
+    };
+
+    // parses the header, leaves data pointing at the first byte after "end_header\n"
+    inline bool readHeader(const char *&data, const char *end, std::vector<Element> &elements)
+    {
+        const char *line = data;
+        bool first = true, binaryLE = false;
+        while (line < end)
+        {
+            const char *lineEnd = static_cast<const char *>(std::memchr(line, '\n', end - line));
+            if (lineEnd == nullptr)
+                return false;
+            TextCursor in{line, lineEnd};
+            line = lineEnd + 1;
+            std::string_view word = in.readWord();
+            if (first)
+            {
+                if (word != "ply")
+                    return false;
+                first = false;
+            }
+            else if (word == "format")
+                binaryLE = in.readWord() == "binary_little_endian";
+            else if (word == "element")
+            {
+                Element element;
+                element.name = std::string(in.readWord());
+                std::string_view count = in.readWord();
+                if (std::from_chars(count.data(), count.data() + count.size(), element.count).ec != std::errc())
+                    return false;
+                elements.push_back(element);
+            }
+            else if (word == "property")
+            {
+                if (elements.empty())
+                    return false;
+                Property property;
+                std::string_view type = in.readWord();
+                if (type == "list")
+                {
+                    property.isList = true;
+                    property.countType = parseType(in.readWord());
+                    if (property.countType == Type::Invalid)
+                        return false;
+                    type = in.readWord();
+                }
+                property.type = parseType(type);
+                property.name = std::string(in.readWord());
+                if (property.type == Type::Invalid)
+                    return false;
+                elements.back().properties.push_back(property);
+            }
+            else if (word == "end_header")
+            {
+                data = line;
+                return binaryLE;
+            }
+        }
+        return false;
+    }
+
+    // size in bytes of the record starting at p, 0 if it does not fit before end
+    inline std::size_t recordSize(Element const &element, const char *p, const char *end)
+    {
+        std::size_t size = 0;
+        for (Property const &property : element.properties)
+        {
+            if (property.isList)
+            {
+                const std::size_t countSize = typeSize(property.countType);
+                if (end - p < (std::ptrdiff_t)(size + countSize))
+                    return 0;
+                // every entry takes at least a byte, which also keeps the size below from overflowing
+                const double n = readValue(p + size, property.countType);
+                if (!(n >= 0) || n > (double)(end - p))
+                    return 0;
+                size += countSize + (std::size_t)n * typeSize(property.type);
+            }
+            else
+                size += typeSize(property.type);
+        }
+        return end - p < (std::ptrdiff_t)size ? 0 : size;
+    }
+}
+
+/*
+ * Reads a binary little-endian PLY file. Vertex records laid out as float x y z [nx ny nz]
+ * are copied in blocks, any other layout is converted per property. Faces are fan-triangulated,
+ * faces with an index outside the file's vertices are dropped.
+ */
+void readPly(std::string const &filename, std::vector<Point> *points, std::vector<Normal> *normals = nullptr, std::vector<std::array<int, 3>> *faces = nullptr,
+             LoadProgress *progress = nullptr)
+{
+    MappedFile file(filename);
+    if (!file.isOpen())
+    {
+        return;
+    }
+    const char *data = file.data();
+    const char *end = file.data() + file.size();
+    std::vector<ply::Element> elements;
+    if (!ply::readHeader(data, end, elements))
+        return;
+    if (progress != nullptr)
+        progress->total = file.size();
+    // face indices refer to the vertices of this file
+    std::size_t vertexCount = 0;
+    for (ply::Element const &element : elements)
+    {
+        if (element.name == "vertex")
+            vertexCount = std::min<std::size_t>(element.count, std::numeric_limits<int>::max());
+    }
+
+    for (ply::Element const &element : elements)
+    {
+        if (progress != nullptr)
+        {
+            progress->done = data - file.data();
+            if (progress->cancelled())
+                return;
+        }
+        if (element.name == "vertex")
+        {
+            const std::size_t stride = element.stride();
+            if (stride == 0 || (std::size_t)(end - data) / stride < element.count)
+                return;
+            int prop[6] = {element.find("x"), element.find("y"), element.find("z"), element.find("nx"), element.find("ny"), element.find("nz")};
+            if (prop[0] < 0 || prop[1] < 0 || prop[2] < 0)
+                return;
+            const bool hasNormals = prop[3] >= 0 && prop[4] >= 0 && prop[5] >= 0;
+            std::size_t offset[6] = {};
+            for (int k = 0; k < (hasNormals ? 6 : 3); k++)
+            {
+                for (int j = 0; j < prop[k]; j++)
+                    offset[k] += ply::typeSize(element.properties[j].type);
+            }
+
+            const std::size_t pointBase = points->size();
+            points->resize(pointBase + element.count);
+            Point *pointOut = points->data() + pointBase;
+            Normal *normalOut = nullptr;
+            if (hasNormals && normals != nullptr)
+            {
+                const std::size_t normalBase = normals->size();
+                normals->resize(normalBase + element.count);
+                normalOut = normals->data() + normalBase;
+            }
+
+            // fast path: float xyz (and float nxnynz right behind) at the start of each record
+            bool packed = ply::hostIsLittleEndian();
+            for (int k = 0; k < (normalOut != nullptr ? 6 : 3); k++)
+                packed = packed && element.properties[prop[k]].type == ply::Type::Float32 && offset[k] == k * sizeof(float);
+            if (packed && stride == sizeof(Point))
+                std::memcpy(pointOut, data, element.count * sizeof(Point));
+            else if (packed)
+            {
+                for (std::size_t i = 0; i < element.count; i++)
+                {
+                    const char *record = data + i * stride;
+                    std::memcpy(&pointOut[i], record, sizeof(Point));
+                    if (normalOut != nullptr)
+                        std::memcpy(&normalOut[i], record + sizeof(Point), sizeof(Normal));
+                }
+            }
+            else
+            {
+                for (std::size_t i = 0; i < element.count; i++)
+                {
+                    const char *record = data + i * stride;
+                    for (int k = 0; k < 3; k++)
+                        pointOut[i][k] = (float)ply::readValue(record + offset[k], element.properties[prop[k]].type);
+                    for (int k = 0; normalOut != nullptr && k < 3; k++)
+                        normalOut[i][k] = (float)ply::readValue(record + offset[3 + k], element.properties[prop[3 + k]].type);
+                }
+            }
+            data += element.count * stride;
+        }
+        else if (element.name == "face" && faces != nullptr)
+        {
+            const int list = std::max(element.find("vertex_indices"), element.find("vertex_index"));
+            if (list < 0 || !element.properties[list].isList)
+                return;
+            std::size_t listOffset = 0;
+            for (int j = 0; j < list; j++)
+                listOffset += ply::typeSize(element.properties[j].type);
+            const ply::Property &indices = element.properties[list];
+            const std::size_t countSize = ply::typeSize(indices.countType);
+            const std::size_t indexSize = ply::typeSize(indices.type);
+            faces->reserve(faces->size() + element.count);
+            for (std::size_t i = 0; i < element.count; i++)
+            {
+                if (progress != nullptr && (i & 0xffff) == 0)
+                {
+                    progress->done = data - file.data();
+                    if (progress->cancelled())
+                        return;
+                }
+                const std::size_t size = ply::recordSize(element, data, end);
+                if (size == 0)
+                    return;
+                // recordSize has checked that the n indices lie inside the file
+                const char *record = data + listOffset;
+                const std::size_t n = (std::size_t)ply::readValue(record, indices.countType);
+                record += countSize;
+                bool valid = true;
+                for (std::size_t j = 0; j < n && valid; j++)
+                {
+                    const double index = ply::readValue(record + j * indexSize, indices.type);
+                    valid = index >= 0 && index < (double)vertexCount;
+                }
+                if (!valid)
+                {
+                    // the polygon is dropped as a whole
+                    if (progress != nullptr && n > 2)
+                        progress->droppedFaces += n - 2;
+                    data += size;
+                    continue;
+                }
+                const int first = (int)ply::readValue(record, indices.type);
+                for (std::size_t j = 1; j + 1 < n; j++)
+                {
+                    faces->push_back(std::array<int, 3>{first,
+                                                        (int)ply::readValue(record + j * indexSize, indices.type),
+                                                        (int)ply::readValue(record + (j + 1) * indexSize, indices.type)});
+                }
+                data += size;
+            }
+        }
+        else
+        {
+            // skip elements we do not read
+            const std::size_t stride = element.stride();
+            for (std::size_t i = 0; i < element.count; i++)
+            {
+                const std::size_t size = stride != 0 ? stride : ply::recordSize(element, data, end);
+                if (size == 0 || (std::size_t)(end - data) < size)
+                    return;
+                data += size;
+            }
+        }
+    }
+}
+
+/*
+ * Writes a binary little-endian PLY file, normals are written when there is one per point
+ */
+template <typename Index>
+bool writePly(std::string const &filename, ArrayView<Point> points, ArrayView<Normal> normals, ArrayView<std::array<Index, 3>> faces)
+{
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return false;
+    const bool hasNormals = !normals.empty() && normals.size() == points.size();
+    out << "ply\nformat binary_little_endian 1.0\n"
+        << "element vertex " << points.size() << "\n"
+        << "property float x\nproperty float y\nproperty float z\n";
+    if (hasNormals)
+        out << "property float nx\nproperty float ny\nproperty float nz\n";
+    out << "element face " << faces.size() << "\n"
+        << "property list uchar int vertex_indices\n"
+        << "end_header\n";
+
+    // records are assembled in blocks, byte-swapped on big-endian hosts
+    auto put = ply::writeWords;
+    const std::size_t blockSize = 1 << 14;
+    std::vector<char> block;
+    const std::size_t vertexSize = hasNormals ? sizeof(Point) + sizeof(Normal) : sizeof(Point);
+    block.resize(blockSize * std::max<std::size_t>(vertexSize, 1 + 3 * sizeof(std::int32_t)));
+    for (std::size_t begin = 0; begin < points.size(); begin += blockSize)
+    {
+        const std::size_t n = std::min(blockSize, points.size() - begin);
+        char *dst = block.data();
+        for (std::size_t i = begin; i < begin + n; i++)
+        {
+            put(dst, points[i].data(), sizeof(Point));
+            dst += sizeof(Point);
+            if (hasNormals)
+            {
+                put(dst, normals[i].data(), sizeof(Normal));
+                dst += sizeof(Normal);
+            }
+        }
+        out.write(block.data(), dst - block.data());
+    }
+    for (std::size_t begin = 0; begin < faces.size(); begin += blockSize)
+    {
+        const std::size_t n = std::min(blockSize, faces.size() - begin);
+        char *dst = block.data();
+        for (std::size_t i = begin; i < begin + n; i++)
+        {
+            *dst++ = 3;
+            const std::int32_t face[3] = {(std::int32_t)faces[i][0], (std::int32_t)faces[i][1], (std::int32_t)faces[i][2]};
+            put(dst, face, sizeof(face));
+            dst += sizeof(face);
+        }
+        out.write(block.data(), dst - block.data());
+    }
+    return (bool)out;
+}
+
+/*
+ * Writes a triangle soup as OBJ, OFF or binary PLY (picked by the file extension) on a background
+ * thread. addTriangle only appends to a batch, full batches are handed to the worker which formats
+ * them into a large buffer and writes it, so output overlaps with the extraction producing the
+ * triangles. Counts are not known up front: OFF/PLY get a fixed-width placeholder that close()
+ * overwrites, and their face lists (always 0 1 2, 3 4 5, ...) are appended by close().
+ */
+class MeshWriter
+{
+public:
+    enum class Format
+    {
+        Obj,
+        Off,
+        Ply
+    };
+
+    MeshWriter() = default;
+    MeshWriter(MeshWriter const &) = delete;
+    MeshWriter &operator=(MeshWriter const &) = delete;
+    ~MeshWriter()
+    {
+        close();
+    }
+
+    bool open(std::string const &filename, bool withNormals)
+    {
+        close();
+        std::string extension = std::filesystem::path(filename).extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c)
+                       { return (char)std::tolower(c); });
+        if (extension == ".obj")
+            m_format = Format::Obj;
+        else if (extension == ".off")
+            m_format = Format::Off;
+        else if (extension == ".ply")
+            m_format = Format::Ply;
+        else
+            return false;
+
+        m_out.open(filename, std::ios::binary | std::ios::trunc);
+        if (!m_out)
+            return false;
+        m_withNormals = withNormals;
+        m_triangles = 0;
+        m_written = 0;
+        m_done = false;
+        writeHeader();
+        m_batch.reserve(batchTriangles * floatsPerTriangle());
+        m_worker = std::thread(&MeshWriter::run, this);
+        return true;
+    }
+
+    bool isOpen() const
+    {
+        return m_worker.joinable();
+    }
+    std::size_t triangleCount() const
+    {
+        return m_triangles;
+    }
+
+    // normals points to the three corner normals, zero normals are written when it is null
+    void addTriangle(Point const &a, Point const &b, Point const &c, Normal const *normals = nullptr)
+    {
+        Point const *corners[3] = {&a, &b, &c};
+        for (int k = 0; k < 3; k++)
+        {
+            m_batch.insert(m_batch.end(), corners[k]->begin(), corners[k]->end());
+            if (m_withNormals)
+            {
+                if (normals != nullptr)
+                    m_batch.insert(m_batch.end(), normals[k].begin(), normals[k].end());
+                else
+                    m_batch.insert(m_batch.end(), 3, 0.0f);
+            }
+        }
+        m_triangles++;
+        if (m_batch.size() >= batchTriangles * floatsPerTriangle())
+            flush();
+    }
+
+    // waits for the worker and completes the file, false if anything could not be written
+    bool close()
+    {
+        if (!isOpen())
+            return false;
+        flush();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_done = true;
+        }
+        m_changed.notify_all();
+        m_worker.join();
+
+        writeFaces();
+        patchHeader();
+        const bool ok = (bool)m_out;
+        m_out.close();
+        return ok;
+    }
+
+private:
+    static constexpr std::size_t batchTriangles = 1 << 15;
+    static constexpr std::size_t maxQueuedBatches = 4;
+    static constexpr int countWidth = 12;
+
+    Format m_format = Format::Ply;
+    bool m_withNormals = false;
+    std::ofstream m_out;
+    std::streampos m_vertexCountPos, m_faceCountPos;
+    std::size_t m_triangles = 0;
+    // triangles the worker has written, only touched by the worker until it is joined
+    std::size_t m_written = 0;
+
+    std::vector<float> m_batch;
+    std::deque<std::vector<float>> m_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    bool m_done = false;
+    std::thread m_worker;
+
+    std::size_t floatsPerTriangle() const
+    {
+        return m_withNormals ? 18 : 9;
+    }
+
+    void flush()
+    {
+        if (m_batch.empty())
+            return;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_changed.wait(lock, [this]
+                           { return m_queue.size() < maxQueuedBatches; });
+            m_queue.push_back(std::move(m_batch));
+        }
+        m_changed.notify_all();
+        m_batch = std::vector<float>();
+        m_batch.reserve(batchTriangles * floatsPerTriangle());
+    }
+
+    void run()
+    {
+        std::vector<char> buffer;
+        for (;;)
+        {
+            std::vector<float> batch;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_changed.wait(lock, [this]
+                               { return m_done || !m_queue.empty(); });
+                if (m_queue.empty())
+                    return;
+                batch = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            m_changed.notify_all();
+            format(batch, buffer);
+            m_out.write(buffer.data(), buffer.size());
+        }
+    }
+
+    static void appendNumber(std::vector<char> &buffer, float value)
+    {
+        char text[32];
+        buffer.insert(buffer.end(), text, std::to_chars(text, text + sizeof(text), value).ptr);
+    }
+    static void appendNumber(std::vector<char> &buffer, std::size_t value)
+    {
+        char text[32];
+        buffer.insert(buffer.end(), text, std::to_chars(text, text + sizeof(text), value).ptr);
+    }
+
+    void format(std::vector<float> const &batch, std::vector<char> &buffer)
+    {
+        buffer.clear();
+        const std::size_t stride = m_withNormals ? 6 : 3;
+        const std::size_t vertices = batch.size() / stride;
+        if (m_format == Format::Ply)
+        {
+            buffer.resize(batch.size() * sizeof(float));
+            ply::writeWords(buffer.data(), batch.data(), buffer.size());
+        }
+        else if (m_format == Format::Off)
+        {
+            for (std::size_t v = 0; v < vertices; v++)
+            {
+                for (std::size_t k = 0; k < stride; k++)
+                {
+                    appendNumber(buffer, batch[v * stride + k]);
+                    buffer.push_back(k + 1 < stride ? ' ' : '\n');
+                }
+            }
+        }
+        else
+        {
+            for (std::size_t t = 0; t < vertices / 3; t++)
+            {
+                for (std::size_t v = 3 * t; v < 3 * t + 3; v++)
+                {
+                    buffer.push_back('v');
+                    for (std::size_t k = 0; k < 3; k++)
+                    {
+                        buffer.push_back(' ');
+                        appendNumber(buffer, batch[v * stride + k]);
+                    }
+                    buffer.push_back('\n');
+                }
+                if (m_withNormals)
+                {
+                    for (std::size_t v = 3 * t; v < 3 * t + 3; v++)
+                    {
+                        buffer.insert(buffer.end(), {'v', 'n'});
+                        for (std::size_t k = 3; k < 6; k++)
+                        {
+                            buffer.push_back(' ');
+                            appendNumber(buffer, batch[v * stride + k]);
+                        }
+                        buffer.push_back('\n');
+                    }
+                }
+                buffer.push_back('f');
+                for (std::size_t k = 1; k <= 3; k++)
+                {
+                    const std::size_t index = 3 * (m_written + t) + k;
+                    buffer.push_back(' ');
+                    appendNumber(buffer, index);
+                    if (m_withNormals)
+                    {
+                        buffer.insert(buffer.end(), {'/', '/'});
+                        appendNumber(buffer, index);
+                    }
+                }
+                buffer.push_back('\n');
+            }
+        }
+        m_written += vertices / 3;
+    }
+
+    void writeHeader()
+    {
+        const std::string placeholder(countWidth, '0');
+        if (m_format == Format::Off)
+        {
+            m_out << (m_withNormals ? "NOFF\n" : "OFF\n");
+            m_vertexCountPos = m_out.tellp();
+            m_out << placeholder << " ";
+            m_faceCountPos = m_out.tellp();
+            m_out << placeholder << " 0\n";
+        }
+        else if (m_format == Format::Ply)
+        {
+            m_out << "ply\nformat binary_little_endian 1.0\nelement vertex ";
+            m_vertexCountPos = m_out.tellp();
+            m_out << placeholder << "\nproperty float x\nproperty float y\nproperty float z\n";
+            if (m_withNormals)
+                m_out << "property float nx\nproperty float ny\nproperty float nz\n";
+            m_out << "element face ";
+            m_faceCountPos = m_out.tellp();
+            m_out << placeholder << "\nproperty list uchar int vertex_indices\nend_header\n";
+        }
+    }
+
+    void writeFaces()
+    {
+        if (m_format == Format::Obj)
+            return;
+        std::vector<char> buffer;
+        for (std::size_t begin = 0; begin < m_triangles; begin += batchTriangles)
+        {
+            const std::size_t end = std::min(m_triangles, begin + batchTriangles);
+            buffer.clear();
+            for (std::size_t t = begin; t < end; t++)
+            {
+                if (m_format == Format::Ply)
+                {
+                    const std::int32_t face[3] = {(std::int32_t)(3 * t), (std::int32_t)(3 * t + 1), (std::int32_t)(3 * t + 2)};
+                    buffer.push_back(3);
+                    buffer.resize(buffer.size() + sizeof(face));
+                    ply::writeWords(buffer.data() + buffer.size() - sizeof(face), face, sizeof(face));
+                }
+                else
+                {
+                    buffer.insert(buffer.end(), {'3', ' '});
+                    appendNumber(buffer, 3 * t);
+                    buffer.push_back(' ');
+                    appendNumber(buffer, 3 * t + 1);
+                    buffer.push_back(' ');
+                    appendNumber(buffer, 3 * t + 2);
+                    buffer.push_back('\n');
+                }
+            }
+            m_out.write(buffer.data(), buffer.size());
+        }
+    }
+
+    void patchHeader()
+    {
+        if (m_format == Format::Obj)
+            return;
+        auto patch = [this](std::streampos pos, std::size_t value)
+        {
+            std::string digits = std::to_string(value);
+            m_out.seekp(pos);
+            m_out << std::string(countWidth - std::min<std::size_t>(countWidth, digits.size()), '0') << digits;
+        };
+        patch(m_vertexCountPos, 3 * m_triangles);
+        patch(m_faceCountPos, m_triangles);
+        m_out.seekp(0, std::ios::end);
+    }
+};
+
+struct EuclideanDistance
+{
+    static float measure(Point const &p1, Point const &p2)
+    {
+        float dx = p1[0] - p2[0];
+        float dy = p1[1] - p2[1];
+        float dz = p1[2] - p2[2];
+        return std::sqrt(dx * dx + dy * dy + dz * dz);
+    }
+};
+struct Math
+{
+    static int fact(int n)
+    {
+        return (n == 0) || (n == 1) ? 1 : n * fact(n - 1);
+    }
+    static float delta(int i, int j)
+    {
+        return (i == j) ? 1.0 : 0.0;
+    }
+};
+struct Bezier
+{
+    static float Bernstein(int m, int i, float u)
+    {
+        if (i < 0 || i > m)
+            return 0.0;
+        if (u == 0.0)
+            return Math::delta(i, 0);
+        if (u == 1.0)
+            return Math::delta(i, m);
+        float a = Math::fact(m) / Math::fact(i) / Math::fact(m - i) * std::pow(1 - u, m - i) * std::pow(u, i);
+        return a;
+    }
+    static float Bderivative(int m, int i, float u)
+    {
+        // float a = Math::fact(m)/Math::fact(i)/Math::fact(m-i)*std::pow(1-u, m-i-1)*std::pow(u, i-1)*(i-m*u);
+        float a = m * (Bezier::Bernstein(m - 1, i - 1, u) - Bezier::Bernstein(m - 1, i, u));
+        return a;
+    }
+    static Point q(int m, int n, float u, float v, PointList WLS)
+    {
+        int t = 0;
+        Point sumI{0.0, 0.0, 0.0};
+        for (int i = 0; i <= m; i++)
+        {
+            Point sumJ{0.0, 0.0, 0.0};
+            for (int j = 0; j <= n; j++)
+            {
+                Point sum1{Bezier::Bernstein(n, j, v) * WLS[t][0], Bezier::Bernstein(n, j, v) * WLS[t][1], Bezier::Bernstein(n, j, v) * WLS[t][2]};
+                sumJ[0] += sum1[0];
+                sumJ[1] += sum1[1];
+                sumJ[2] += sum1[2];
+                t += 1;
+            }
+            Point sum2{Bezier::Bernstein(m, i, u) * sumJ[0], Bezier::Bernstein(m, i, u) * sumJ[1], Bezier::Bernstein(m, i, u) * sumJ[2]};
+            sumI[0] += sum2[0];
+            sumI[1] += sum2[1];
+            sumI[2] += sum2[2];
+        }
+        return sumI;
+    }
+    static Point q_u(int m, int n, float u, float v, PointList WLS)
+    {
+        int t = 0;
+        Point sumI{0.0, 0.0, 0.0};
+        for (int i = 0; i <= m; i++)
+        {
+            Point sumJ{0.0, 0.0, 0.0};
+            for (int j = 0; j <= n; j++)
+            {
+                Point sum1{Bezier::Bernstein(n, j, v) * WLS[t][0], Bezier::Bernstein(n, j, v) * WLS[t][1], Bezier::Bernstein(n, j, v) * WLS[t][2]};
+                sumJ[0] += sum1[0];
+                sumJ[1] += sum1[1];
+                sumJ[2] += sum1[2];
+                t += 1;
+            }
+            Point sum2{Bezier::Bderivative(m, i, u) * sumJ[0], Bezier::Bderivative(m, i, u) * sumJ[1], Bezier::Bderivative(m, i, u) * sumJ[2]};
+            sumI[0] += sum2[0];
+            sumI[1] += sum2[1];
+            sumI[2] += sum2[2];
+        }
+        return sumI;
+    }
+    static Point q_v(int m, int n, float u, float v, PointList WLS)
+    {
+
+        int t = 0;
+        Point sumI{0.0, 0.0, 0.0};
+        for (int i = 0; i <= m; i++)
+        {
+            Point sumJ{0.0, 0.0, 0.0};
+            for (int j = 0; j <= n; j++)
+            {
+                Point sum1{Bezier::Bderivative(n, j, v) * WLS[t][0], Bezier::Bderivative(n, j, v) * WLS[t][1], Bezier::Bderivative(n, j, v) * WLS[t][2]};
+                sumJ[0] += sum1[0];
+                sumJ[1] += sum1[1];
+                sumJ[2] += sum1[2];
+                t += 1;
+            }
+            Point sum2{Bezier::Bernstein(m, i, u) * sumJ[0], Bezier::Bernstein(m, i, u) * sumJ[1], Bezier::Bernstein(m, i, u) * sumJ[2]};
+            sumI[0] += sum2[0];
+            sumI[1] += sum2[1];
+            sumI[2] += sum2[2];
+        }
+        return sumI;
+    }
+    static std::array<float, 3> normal(int m, int n, float u, float v, PointList WLS)
+    {
+        Point q_u = Bezier::q_u(m, n, u, v, WLS);
+        Point q_v = Bezier::q_v(m, n, u, v, WLS);
+        float x = q_u[1] * q_v[2] - q_u[2] * q_v[1];
+        float y = q_u[2] * q_v[0] - q_u[0] * q_v[2];
+        float z = q_u[0] * q_v[1] - q_u[1] * q_v[0];
+        float leng = std::sqrt(x * x + y * y + z * z);
+        std::array<float, 3> normal = {x / leng * (float)0.05, y / leng * (float)0.05, z / leng * (float)0.05};
+        return normal;
+    }
+};
+
+/*
+ * Squared distances from q to n points given as separate x, y and z arrays. Uses AVX2 or SSE
+ * when the compiler targets them (Release builds use -march=native) and plain loops otherwise.
+ */
+inline void squaredDistances(const float *xs, const float *ys, const float *zs, std::size_t n, Point const &q, float *out)
+{
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    const __m256 qx8 = _mm256_set1_ps(q[0]), qy8 = _mm256_set1_ps(q[1]), qz8 = _mm256_set1_ps(q[2]);
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs + i), qx8);
+        const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys + i), qy8);
+        const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(zs + i), qz8);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+    const __m128 qx4 = _mm_set1_ps(q[0]), qy4 = _mm_set1_ps(q[1]), qz4 = _mm_set1_ps(q[2]);
+    for (; i + 4 <= n; i += 4)
+    {
+        const __m128 dx = _mm_sub_ps(_mm_loadu_ps(xs + i), qx4);
+        const __m128 dy = _mm_sub_ps(_mm_loadu_ps(ys + i), qy4);
+        const __m128 dz = _mm_sub_ps(_mm_loadu_ps(zs + i), qz4);
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        const float dx = xs[i] - q[0], dy = ys[i] - q[1], dz = zs[i] - q[2];
+        out[i] = dx * dx + dy * dy + dz * dz;
+    }
+}
+
+/*
+ * Results of a batched query in compressed sparse row form: the neighbours of query q are
+ * indices[offsets[q]] ... indices[offsets[q + 1] - 1], distances (when requested) parallel to indices.
+ */
+struct NeighborLists
+{
+    std::vector<std::size_t> offsets{0};
+    std::vector<std::size_t> indices;
+    std::vector<float> distances;
+
+    std::size_t size() const
+    {
+        return offsets.size() - 1;
+    }
+    ArrayView<std::size_t> neighbors(std::size_t q) const
+    {
+        return ArrayView<std::size_t>(indices.data() + offsets[q], offsets[q + 1] - offsets[q]);
+    }
+    ArrayView<float> neighborDistances(std::size_t q) const
+    {
+        return ArrayView<float>(distances.data() + offsets[q], distances.empty() ? 0 : offsets[q + 1] - offsets[q]);
+    }
+};
+
+/*
+ * Runs query(q, indices, distances, scratch) for q = 0 ... nQueries - 1 on up to numThreads threads
+ * (0 uses all cores) and gathers the results into NeighborLists. The query appends its neighbours
+ * (and their distances if distances is not null). Threads take blocks of queries as they become
+ * free and keep their own output and Scratch between queries, the lists are in query order.
+ */
+template <typename Scratch, typename Query>
+NeighborLists runBatch(std::size_t nQueries, bool withDistances, unsigned int numThreads, Query const &query)
+{
+    const std::size_t blockSize = 256;
+    const std::size_t nBlocks = (nQueries + blockSize - 1) / blockSize;
+    if (numThreads == 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    numThreads = (unsigned int)std::max<std::size_t>(1, std::min<std::size_t>(numThreads, nBlocks));
+
+    struct Local
+    {
+        std::vector<std::size_t> indices;
+        std::vector<float> distances;
+        // (block, first entry in indices) for every block this thread ran
+        std::vector<std::pair<std::size_t, std::size_t>> blocks;
+        Scratch scratch;
+    };
+    std::vector<Local> locals(numThreads);
+    std::vector<std::size_t> counts(nQueries);
+    std::atomic<std::size_t> nextBlock{0};
+    auto work = [&](unsigned int t)
+    {
+        Local &local = locals[t];
+        for (std::size_t block = nextBlock++; block < nBlocks; block = nextBlock++)
+        {
+            local.blocks.emplace_back(block, local.indices.size());
+            for (std::size_t q = block * blockSize; q < std::min(nQueries, (block + 1) * blockSize); q++)
+            {
+                const std::size_t before = local.indices.size();
+                query(q, local.indices, withDistances ? &local.distances : nullptr, local.scratch);
+                counts[q] = local.indices.size() - before;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < numThreads; t++)
+        workers.emplace_back(work, t);
+    work(0);
+    for (auto &worker : workers)
+        worker.join();
+
+    NeighborLists result;
+    result.offsets.resize(nQueries + 1);
+    for (std::size_t q = 0; q < nQueries; q++)
+        result.offsets[q + 1] = result.offsets[q] + counts[q];
+    if (numThreads == 1)
+    {
+        // one thread ran every block in order, its lists are the result
+        result.indices = std::move(locals[0].indices);
+        result.distances = std::move(locals[0].distances);
+        return result;
+    }
+    result.indices.resize(result.offsets.back());
+    if (withDistances)
+        result.distances.resize(result.offsets.back());
+    for (Local const &local : locals)
+    {
+        for (auto const &[block, first] : local.blocks)
+        {
+            const std::size_t begin = result.offsets[block * blockSize];
+            const std::size_t n = result.offsets[std::min(nQueries, (block + 1) * blockSize)] - begin;
+            std::copy(local.indices.begin() + first, local.indices.begin() + first + n, result.indices.begin() + begin);
+            if (withDistances)
+                std::copy(local.distances.begin() + first, local.distances.begin() + first + n, result.distances.begin() + begin);
+        }
+    }
+    return result;
+}
+
+/*
+ * Runs body(i) for i = 0 ... n - 1 on up to numThreads threads (0 uses all cores), which take
+ * blocks of indices as they become free like runBatch does
+ */
+template <typename Body>
+void parallelFor(std::size_t n, unsigned int numThreads, Body const &body)
+{
+    const std::size_t blockSize = 256;
+    const std::size_t nBlocks = (n + blockSize - 1) / blockSize;
+    if (numThreads == 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    numThreads = (unsigned int)std::max<std::size_t>(1, std::min<std::size_t>(numThreads, nBlocks));
+
+    std::atomic<std::size_t> nextBlock{0};
+    auto work = [&]
+    {
+        for (std::size_t block = nextBlock++; block < nBlocks; block = nextBlock++)
+        {
+            for (std::size_t i = block * blockSize; i < std::min(n, (block + 1) * blockSize); i++)
+                body(i);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < numThreads; t++)
+        workers.emplace_back(work);
+    work();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+/*
+ * Per-axis absolute differences to q combined by sum (L1) or maximum (L-infinity), vectorized like
+ * squaredDistances.
+ */
+template <bool Maximum>
+inline void absoluteDistances(const float *xs, const float *ys, const float *zs, std::size_t n, Point const &q, float *out)
+{
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    const __m256 sign8 = _mm256_set1_ps(-0.0f);
+    const __m256 qx8 = _mm256_set1_ps(q[0]), qy8 = _mm256_set1_ps(q[1]), qz8 = _mm256_set1_ps(q[2]);
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256 dx = _mm256_andnot_ps(sign8, _mm256_sub_ps(_mm256_loadu_ps(xs + i), qx8));
+        const __m256 dy = _mm256_andnot_ps(sign8, _mm256_sub_ps(_mm256_loadu_ps(ys + i), qy8));
+        const __m256 dz = _mm256_andnot_ps(sign8, _mm256_sub_ps(_mm256_loadu_ps(zs + i), qz8));
+        _mm256_storeu_ps(out + i, Maximum ? _mm256_max_ps(_mm256_max_ps(dx, dy), dz) : _mm256_add_ps(_mm256_add_ps(dx, dy), dz));
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+    const __m128 sign4 = _mm_set1_ps(-0.0f);
+    const __m128 qx4 = _mm_set1_ps(q[0]), qy4 = _mm_set1_ps(q[1]), qz4 = _mm_set1_ps(q[2]);
+    for (; i + 4 <= n; i += 4)
+    {
+        const __m128 dx = _mm_andnot_ps(sign4, _mm_sub_ps(_mm_loadu_ps(xs + i), qx4));
+        const __m128 dy = _mm_andnot_ps(sign4, _mm_sub_ps(_mm_loadu_ps(ys + i), qy4));
+        const __m128 dz = _mm_andnot_ps(sign4, _mm_sub_ps(_mm_loadu_ps(zs + i), qz4));
+        _mm_storeu_ps(out + i, Maximum ? _mm_max_ps(_mm_max_ps(dx, dy), dz) : _mm_add_ps(_mm_add_ps(dx, dy), dz));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        const float dx = std::fabs(xs[i] - q[0]), dy = std::fabs(ys[i] - q[1]), dz = std::fabs(zs[i] - q[2]);
+        out[i] = Maximum ? std::max(std::max(dx, dy), dz) : dx + dy + dz;
+    }
+}
+
+/*
+ * Metric policies for BasicSpatialDataStructure. The tree compares the values of measure, which
+ * need not be the distance itself: fromDistance turns a radius into such a value and toDistance
+ * turns one back, planeBound is the smallest value a point can have that lies beyond a split
+ * plane at offset diff from the query, boxBound the smallest value inside a box that is dx, dy
+ * and dz away from the query along the axes, and leaf evaluates a whole bucket.
+ */
+struct SquaredEuclideanDistance
+{
+    static float measure(Point const &p1, Point const &p2)
+    {
+        const float dx = p1[0] - p2[0], dy = p1[1] - p2[1], dz = p1[2] - p2[2];
+        return dx * dx + dy * dy + dz * dz;
+    }
+    static float fromDistance(float distance)
+    {
+        return distance * distance;
+    }
+    static float toDistance(float value)
+    {
+        return std::sqrt(value);
+    }
+    static float planeBound(float diff)
+    {
+        return diff * diff;
+    }
+    static float boxBound(float dx, float dy, float dz)
+    {
+        return dx * dx + dy * dy + dz * dz;
+    }
+    static void leaf(const float *xs, const float *ys, const float *zs, std::size_t n, Point const &q, float *out)
+    {
+        squaredDistances(xs, ys, zs, n, q, out);
+    }
+};
+
+struct ManhattanDistance
+{
+    static float measure(Point const &p1, Point const &p2)
+    {
+        return std::fabs(p1[0] - p2[0]) + std::fabs(p1[1] - p2[1]) + std::fabs(p1[2] - p2[2]);
+    }
+    static float fromDistance(float distance)
+    {
+        return distance;
+    }
+    static float toDistance(float value)
+    {
+        return value;
+    }
+    static float planeBound(float diff)
+    {
+        return std::fabs(diff);
+    }
+    static float boxBound(float dx, float dy, float dz)
+    {
+        return dx + dy + dz;
+    }
+    static void leaf(const float *xs, const float *ys, const float *zs, std::size_t n, Point const &q, float *out)
+    {
+        absoluteDistances<false>(xs, ys, zs, n, q, out);
+    }
+};
+
+struct ChebyshevDistance
+{
+    static float measure(Point const &p1, Point const &p2)
+    {
+        return std::max(std::max(std::fabs(p1[0] - p2[0]), std::fabs(p1[1] - p2[1])), std::fabs(p1[2] - p2[2]));
+    }
+    static float fromDistance(float distance)
+    {
+        return distance;
+    }
+    static float toDistance(float value)
+    {
+        return value;
+    }
+    static float planeBound(float diff)
+    {
+        return std::fabs(diff);
+    }
+    static float boxBound(float dx, float dy, float dz)
+    {
+        return std::max(std::max(dx, dy), dz);
+    }
+    static void leaf(const float *xs, const float *ys, const float *zs, std::size_t n, Point const &q, float *out)
+    {
+        absoluteDistances<true>(xs, ys, zs, n, q, out);
+    }
+};
+
+/*
+ * kd-tree stored in flat arrays. Ranges of at most bucketSize points are leaves, larger ranges are
+ * split at their median on the axis cycling with the depth. Split values live in heap order
+ * (children of node i are 2i + 1 and 2i + 2), the points are permuted so every subtree is one
+ * contiguous range and kept structure-of-arrays, so a leaf is scanned in one Metric::leaf call.
+ * Every node, leaves included, also keeps the tight bounding box of its points in heap order, and
+ * a subtree is only entered when the query can be closer to its box than the current bound.
+ * Radii, pruning and the reported distances all follow the Metric policy, resolved at compile time.
+ */
+template <typename Metric = SquaredEuclideanDistance>
+class BasicSpatialDataStructure
+{
+public:
+    static constexpr std::size_t maxBucketSize = 64;
+
+    // empty tree, to be built or restored
+    BasicSpatialDataStructure() = default;
+
+    BasicSpatialDataStructure(PointList const &points, std::size_t bucketSize = 32, unsigned int numThreads = 0)
+        : m_points(points)
+    {
+        build(points, bucketSize, numThreads);
+    }
+
+    // takes over the point list instead of copying it
+    BasicSpatialDataStructure(PointList &&points, std::size_t bucketSize = 32, unsigned int numThreads = 0)
+        : m_points(std::move(points))
+    {
+        build(m_points, bucketSize, numThreads);
+    }
+
+    ArrayView<Point> getPoints() const
+    {
+        return m_points;
+    }
+    Point const &point(std::size_t i) const
+    {
+        return m_points[i];
+    }
+
+    /*
+     * Builds the tree with up to numThreads threads (0 uses all cores). Points are ordered by
+     * coordinate and then by index and leaves are sorted by index, so the tree does not depend on
+     * the number of threads or on how a range was partitioned.
+     */
+    void build(ArrayView<Point> points, std::size_t bucketSize = 32, unsigned int numThreads = 0)
+    {
+        m_bucketSize = std::clamp<std::size_t>(bucketSize, 1, maxBucketSize);
+        if (numThreads == 0)
+            numThreads = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<int> indices(points.size());
+        std::iota(std::begin(indices), std::end(indices), 0);
+
+        m_splits = std::vector<float>(splitCount(points.size(), 0, m_bucketSize), 0.0f);
+        buildRecursive(indices.data(), (int)points.size(), 0, 0, numThreads);
+        std::vector<float> xs(indices.size()), ys(indices.size()), zs(indices.size());
+        for (std::size_t i = 0; i < indices.size(); i++)
+        {
+            xs[i] = points[indices[i]][0];
+            ys[i] = points[indices[i]][1];
+            zs[i] = points[indices[i]][2];
+        }
+        m_x = std::move(xs);
+        m_y = std::move(ys);
+        m_z = std::move(zs);
+        m_indices = std::move(indices);
+        m_boxes = std::vector<float>(6 * boxCount(points.size(), 0, m_bucketSize), 0.0f);
+        if (!m_indices.empty())
+            buildBoxes(0, 0, (int)m_indices.size());
+    }
+
+    std::size_t bucketSize() const
+    {
+        return m_bucketSize;
+    }
+
+    // length of the heap-ordered split array needed for npoints points below node
+    static std::size_t splitCount(std::size_t npoints, std::size_t node, std::size_t bucketSize)
+    {
+        if (npoints <= bucketSize)
+            return 0;
+        return std::max({node + 1, splitCount(npoints / 2, 2 * node + 1, bucketSize), splitCount(npoints - npoints / 2, 2 * node + 2, bucketSize)});
+    }
+
+    // length of the heap-ordered box array, which unlike the splits also covers the leaves
+    static std::size_t boxCount(std::size_t npoints, std::size_t node, std::size_t bucketSize)
+    {
+        if (npoints <= bucketSize)
+            return node + 1;
+        return std::max(boxCount(npoints / 2, 2 * node + 1, bucketSize), boxCount(npoints - npoints / 2, 2 * node + 2, bucketSize));
+    }
+
+    // the arrays of the built tree as KdSplits ... KdIndices sections, see saveTreeSnapshot
+    std::vector<MeshCache::Blob> snapshotSections() const
+    {
+        return {MeshCache::blob(CacheSection::KdSplits, ArrayView<float>(m_splits.data(), m_splits.size())),
+                MeshCache::blob(CacheSection::KdBoxes, ArrayView<float>(m_boxes.data(), m_boxes.size())),
+                MeshCache::blob(CacheSection::KdX, ArrayView<float>(m_x.data(), m_x.size())),
+                MeshCache::blob(CacheSection::KdY, ArrayView<float>(m_y.data(), m_y.size())),
+                MeshCache::blob(CacheSection::KdZ, ArrayView<float>(m_z.data(), m_z.size())),
+                MeshCache::blob(CacheSection::KdIndices, ArrayView<int>(m_indices.data(), m_indices.size()))};
+    }
+
+    /*
+     * Takes the tree over the given points from the sections of a snapshot instead of building it.
+     * The arrays stay in the mapping, which the tree keeps alive, and points are taken as they are,
+     * so a tree over points mapped from the same cache is restored without copying anything.
+     * Fails and leaves the tree unchanged unless every array has the size the points and bucket
+     * size call for and every stored point is the point its index refers to.
+     */
+    bool restore(std::shared_ptr<const MeshCache> const &cache, MappedArray<Point> points, std::size_t bucketSize)
+    {
+        return restore(cache->section<float>(CacheSection::KdSplits), cache->section<float>(CacheSection::KdBoxes), cache->section<float>(CacheSection::KdX),
+                       cache->section<float>(CacheSection::KdY), cache->section<float>(CacheSection::KdZ), cache->section<int>(CacheSection::KdIndices), bucketSize,
+                       &points, cache);
+    }
+
+    /*
+     * The same from the arrays themselves, in snapshotSections order, viewed while owner keeps them
+     * alive and copied without one. Without points the points are taken from the arrays, which
+     * then have to hold every index exactly once.
+     */
+    bool restore(ArrayView<float> splits, ArrayView<float> boxes, ArrayView<float> xs, ArrayView<float> ys, ArrayView<float> zs, ArrayView<int> indices,
+                 std::size_t bucketSize, MappedArray<Point> *points = nullptr, std::shared_ptr<const void> const &owner = nullptr)
+    {
+        if (bucketSize < 1 || bucketSize > maxBucketSize)
+            return false;
+        const std::size_t n = points != nullptr ? points->size() : indices.size();
+        if (splits.size() != splitCount(n, 0, bucketSize) || boxes.size() != 6 * boxCount(n, 0, bucketSize) || xs.size() != n || ys.size() != n || zs.size() != n || indices.size() != n)
+            return false;
+        PointList stored;
+        std::vector<bool> seen;
+        if (points == nullptr)
+        {
+            stored.resize(n);
+            seen.assign(n, false);
+        }
+        for (std::size_t i = 0; i < n; i++)
+        {
+            const int idx = indices[i];
+            if (idx < 0 || (std::size_t)idx >= n)
+                return false;
+            if (points == nullptr)
+            {
+                if (seen[idx])
+                    return false;
+                seen[idx] = true;
+                stored[idx] = Point{xs[i], ys[i], zs[i]};
+            }
+            else if ((*points)[idx][0] != xs[i] || (*points)[idx][1] != ys[i] || (*points)[idx][2] != zs[i])
+                return false;
+        }
+
+        m_points = points != nullptr ? std::move(*points) : MappedArray<Point>(std::move(stored));
+        m_bucketSize = bucketSize;
+        m_splits = MappedArray<float>(splits, owner);
+        m_boxes = MappedArray<float>(boxes, owner);
+        m_x = MappedArray<float>(xs, owner);
+        m_y = MappedArray<float>(ys, owner);
+        m_z = MappedArray<float>(zs, owner);
+        m_indices = MappedArray<int>(indices, owner);
+        return true;
+    }
+
+    std::vector<std::size_t> collectInRadius(const Point &p, float radius) const
+    {
+        std::vector<std::size_t> result;
+        forEachInRadius(p, radius, [&](std::size_t idx, Point const &, float)
+                        { result.push_back(idx); });
+
+        return result;
+    }
+
+    // true as soon as one point closer than radius is found
+    bool anyInRadius(const Point &p, float radius) const
+    {
+        return anyInRadiusRecursive(p, 0, 0, (int)m_indices.size(), 0, Metric::fromDistance(radius));
+    }
+
+    std::size_t countInRadius(const Point &p, float radius) const
+    {
+        std::size_t count = 0;
+        forEachInRadius(p, radius, [&](std::size_t, Point const &, float)
+                        { count++; });
+        return count;
+    }
+
+    // the nearest point closer than radius, false if there is none
+    bool nearestWithin(const Point &p, float radius, std::size_t *index, float *distance = nullptr) const
+    {
+        float best = Metric::fromDistance(radius);
+        int bestIdx = -1;
+        nearestWithinRecursive(p, 0, 0, (int)m_indices.size(), 0, best, bestIdx);
+        if (bestIdx < 0)
+            return false;
+        *index = bestIdx;
+        if (distance != nullptr)
+            *distance = Metric::toDistance(best);
+        return true;
+    }
+
+    /*
+     * Calls visitor(index, point, measure) for every point closer than radius, straight from the
+     * traversal and without allocating. The measure is the squared distance for the default metric.
+     */
+    template <typename Visitor>
+    void forEachInRadius(const Point &p, float radius, Visitor &&visitor) const
+    {
+        forEachInRadiusRecursive<true>(p, 0, 0, (int)m_indices.size(), 0, Metric::fromDistance(radius), visitor);
+    }
+
+    // at most k indices sorted by distance, distances receives their distances under Metric
+    std::vector<std::size_t> collectKNearest(const Point &p, unsigned int k, std::vector<float> *distances = nullptr) const
+    {
+        std::vector<std::pair<float, int>> heap;
+        heap.reserve(std::min<std::size_t>(k, m_indices.size()));
+        if (k > 0)
+            collectKNearestRecursive<true>(p, 0, 0, (int)m_indices.size(), 0, heap, k);
+        std::sort_heap(heap.begin(), heap.end());
+
+        std::vector<std::size_t> result(heap.size());
+        for (std::size_t i = 0; i < heap.size(); i++)
+            result[i] = heap[i].second;
+        if (distances != nullptr)
+        {
+            distances->resize(heap.size());
+            for (std::size_t i = 0; i < heap.size(); i++)
+                (*distances)[i] = Metric::toDistance(heap[i].first);
+        }
+        return result;
+    }
+
+    /*
+     * (1 + epsilon)-approximate kNN: the i-th returned point is at most 1 + epsilon times as far as
+     * the true i-th nearest, and subtrees that cannot beat the current k-th candidate by that factor
+     * are skipped. error receives the relative distance error the search can still guarantee, the
+     * k-th distance over the smallest bound of any skipped subtree minus one (0 when the result
+     * is exact), which is usually well below epsilon.
+     */
+    std::vector<std::size_t> collectKNearestApprox(const Point &p, unsigned int k, float epsilon, std::vector<float> *distances = nullptr, float *error = nullptr) const
+    {
+        std::vector<std::pair<float, int>> heap;
+        heap.reserve(std::min<std::size_t>(k, m_indices.size()));
+        float pruned = std::numeric_limits<float>::infinity();
+        if (k > 0)
+            collectKNearestRecursive<true>(p, 0, 0, (int)m_indices.size(), 0, heap, k, Metric::fromDistance(1 + std::max(epsilon, 0.0f)), &pruned);
+        std::sort_heap(heap.begin(), heap.end());
+
+        std::vector<std::size_t> result(heap.size());
+        for (std::size_t i = 0; i < heap.size(); i++)
+            result[i] = heap[i].second;
+        if (distances != nullptr)
+        {
+            distances->resize(heap.size());
+            for (std::size_t i = 0; i < heap.size(); i++)
+                (*distances)[i] = Metric::toDistance(heap[i].first);
+        }
+        if (error != nullptr)
+        {
+            *error = 0;
+            if (!heap.empty() && pruned < heap.back().first)
+                *error = Metric::toDistance(heap.back().first) / Metric::toDistance(pruned) - 1;
+        }
+        return result;
+    }
+
+    // collectInRadius for every query point, see runBatch
+    NeighborLists collectInRadiusBatch(ArrayView<Point> queries, float radius, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        const float limit = Metric::fromDistance(radius);
+        return runBatch<char>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, char &)
+                              {
+            auto collect = [&](std::size_t idx, Point const &, float measure)
+            {
+                indices.push_back(idx);
+                if (distances != nullptr)
+                    distances->push_back(Metric::toDistance(measure));
+            };
+            forEachInRadiusRecursive<true>(queries[q], 0, 0, (int)m_indices.size(), 0, limit, collect); });
+    }
+
+    // collectKNearest for every query point, see runBatch
+    NeighborLists collectKNearestBatch(ArrayView<Point> queries, unsigned int k, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        return runBatch<std::vector<std::pair<float, int>>>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, std::vector<std::pair<float, int>> &heap)
+                                                            {
+            heap.clear();
+            if (k > 0)
+                collectKNearestRecursive<true>(queries[q], 0, 0, (int)m_indices.size(), 0, heap, k);
+            std::sort_heap(heap.begin(), heap.end());
+            for (auto const &entry : heap)
+            {
+                indices.push_back(entry.second);
+                if (distances != nullptr)
+                    distances->push_back(Metric::toDistance(entry.first));
+            } });
+    }
+
+    /*
+     * Takes point index out of all later queries by moving its copy in the tree to infinity, the
+     * splits and boxes stay as they are. False if the tree does not hold the point (any more).
+     */
+    bool erase(std::size_t index)
+    {
+        return index < m_points.size() && eraseRecursive(m_points[index], (int)index, 0, 0, (int)m_indices.size(), 0);
+    }
+
+    /*
+     * Nodes, leaves included, that one radius or kNN query enters with box pruning or, as the tree
+     * searched before, with the split planes alone. Only used by --bench-boxes.
+     */
+    std::size_t visitedNodesInRadius(const Point &p, float radius, bool boxes) const
+    {
+        std::size_t visited = 0;
+        auto ignore = [](std::size_t, Point const &, float) {};
+        if (boxes)
+            forEachInRadiusRecursive<true>(p, 0, 0, (int)m_indices.size(), 0, Metric::fromDistance(radius), ignore, &visited);
+        else
+            forEachInRadiusRecursive<false>(p, 0, 0, (int)m_indices.size(), 0, Metric::fromDistance(radius), ignore, &visited);
+        return visited;
+    }
+    std::size_t visitedNodesKNearest(const Point &p, unsigned int k, bool boxes) const
+    {
+        std::size_t visited = 0;
+        std::vector<std::pair<float, int>> heap;
+        if (k == 0)
+            return 0;
+        if (boxes)
+            collectKNearestRecursive<true>(p, 0, 0, (int)m_indices.size(), 0, heap, k, 1.0f, nullptr, &visited);
+        else
+            collectKNearestRecursive<false>(p, 0, 0, (int)m_indices.size(), 0, heap, k, 1.0f, nullptr, &visited);
+        return visited;
+    }
+
+    // the original kNN search, sorting its whole candidate vector again after every point, only
+    // kept as the reference of --bench-knn
+    std::vector<std::size_t> collectKNearestBaseline(const Point &p, unsigned int k) const
+    {
+        std::vector<std::size_t> result;
+        std::vector<std::pair<float, int>> queue;
+        collectKNearestBaselineRecursive(p, 0, 0, (int)m_indices.size(), 0, queue, k);
+        for (std::size_t i = 0; i < queue.size(); i++)
+            result.push_back(queue[i].second);
+
+        return result;
+    }
+
+private:
+    // owned after a build, possibly viewed in a cache mapping after a restore
+    MappedArray<Point> m_points;
+    std::size_t m_bucketSize = 32;
+    MappedArray<float> m_splits;
+    // per node the minimum x, y, z and then the maximum x, y, z of its points
+    MappedArray<float> m_boxes;
+    MappedArray<float> m_x, m_y, m_z;
+    MappedArray<int> m_indices;
+
+    // ranges at least this large get their subtrees built by separate tasks / selected in parallel
+    static constexpr int parallelBuildSize = 1 << 15;
+    static constexpr int parallelSelectSize = 1 << 18;
+
+    // points ordered by one coordinate, ties broken by index
+    bool less(int lhs, int rhs, int axis) const
+    {
+        const float a = m_points[lhs][axis], b = m_points[rhs][axis];
+        return (a < b) | ((a == b) & (lhs < rhs));
+    }
+
+    // unique sort key ordered like less: the coordinate's bits mapped to unsigned order (-0 as +0), then the index
+    std::uint64_t key(int idx, int axis) const
+    {
+        std::uint32_t bits;
+        std::memcpy(&bits, &m_points[idx][axis], sizeof(bits));
+        if (bits == 0x80000000u)
+            bits = 0;
+        bits = (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+        return (std::uint64_t(bits) << 32) | std::uint32_t(idx);
+    }
+
+    void buildBoxes(std::size_t node, int begin, int end)
+    {
+        float *box = &m_boxes.owned()[6 * node];
+        if (end - begin <= (int)m_bucketSize)
+        {
+            box[0] = box[3] = m_x[begin];
+            box[1] = box[4] = m_y[begin];
+            box[2] = box[5] = m_z[begin];
+            for (int i = begin + 1; i < end; i++)
+            {
+                box[0] = std::min(box[0], m_x[i]);
+                box[1] = std::min(box[1], m_y[i]);
+                box[2] = std::min(box[2], m_z[i]);
+                box[3] = std::max(box[3], m_x[i]);
+                box[4] = std::max(box[4], m_y[i]);
+                box[5] = std::max(box[5], m_z[i]);
+            }
+            return;
+        }
+
+        const int mid = begin + (end - begin) / 2;
+        buildBoxes(2 * node + 1, begin, mid);
+        buildBoxes(2 * node + 2, mid, end);
+        const float *left = &m_boxes[6 * (2 * node + 1)], *right = &m_boxes[6 * (2 * node + 2)];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            box[axis] = std::min(left[axis], right[axis]);
+            box[axis + 3] = std::max(left[axis + 3], right[axis + 3]);
+        }
+    }
+
+    // smallest Metric value a point in the box of node can have, 0 if q is inside it
+    float boxBound(Point const &q, std::size_t node) const
+    {
+        const float *box = &m_boxes[6 * node];
+        const float dx = std::max(std::max(box[0] - q[0], q[0] - box[3]), 0.0f);
+        const float dy = std::max(std::max(box[1] - q[1], q[1] - box[4]), 0.0f);
+        const float dz = std::max(std::max(box[2] - q[2], q[2] - box[5]), 0.0f);
+        return Metric::boxBound(dx, dy, dz);
+    }
+
+    void buildRecursive(int *indices, int npoints, int depth, std::size_t node, unsigned int numThreads)
+    {
+        if (npoints <= (int)m_bucketSize)
+        {
+            std::sort(indices, indices + npoints);
+            return;
+        }
+
+        const int axis = depth % 3;
+        const int mid = npoints / 2;
+        if (numThreads > 1 && npoints >= parallelSelectSize)
+            parallelSelect(indices, npoints, mid, axis, numThreads);
+        else
+            std::nth_element(indices, indices + mid, indices + npoints, [&](int lhs, int rhs)
+                             { return less(lhs, rhs, axis); });
+        // build replaced m_splits with an owned array, so owned() never copies here
+        m_splits.owned()[node] = m_points[indices[mid]][axis];
+
+        if (numThreads > 1 && npoints >= parallelBuildSize)
+        {
+            const unsigned int leftThreads = numThreads / 2;
+            std::future<void> left = std::async(std::launch::async, [=]
+                                                { buildRecursive(indices, mid, depth + 1, 2 * node + 1, leftThreads); });
+            buildRecursive(indices + mid, npoints - mid, depth + 1, 2 * node + 2, numThreads - leftThreads);
+            left.get();
+        }
+        else
+        {
+            buildRecursive(indices, mid, depth + 1, 2 * node + 1, 1);
+            buildRecursive(indices + mid, npoints - mid, depth + 1, 2 * node + 2, 1);
+        }
+    }
+
+    /*
+     * Same result as nth_element on key: radix selection of the k-th key over 16-bit digits with
+     * one histogram per thread, then a stable parallel partition around it through a scratch buffer.
+     */
+    void parallelSelect(int *indices, int npoints, int k, int axis, unsigned int numThreads)
+    {
+        const std::size_t n = npoints;
+        const std::size_t chunk = (n + numThreads - 1) / numThreads;
+        auto parallel = [&](auto const &work)
+        {
+            std::vector<std::thread> workers;
+            for (unsigned int t = 1; t < numThreads && t * chunk < n; t++)
+                workers.emplace_back([&work, t, chunk, n]
+                                     { work(t, t * chunk, std::min(n, (t + 1) * chunk)); });
+            work(0u, std::size_t(0), std::min(n, chunk));
+            for (auto &worker : workers)
+                worker.join();
+        };
+
+        std::vector<std::vector<std::uint32_t>> histograms(numThreads, std::vector<std::uint32_t>(1 << 16));
+        std::uint64_t prefix = 0, mask = 0;
+        std::size_t rank = k;
+        for (int shift = 48; shift >= 0; shift -= 16)
+        {
+            parallel([&](unsigned int t, std::size_t begin, std::size_t end)
+                     {
+                std::vector<std::uint32_t> &histogram = histograms[t];
+                std::fill(histogram.begin(), histogram.end(), 0);
+                for (std::size_t i = begin; i < end; i++)
+                {
+                    const std::uint64_t value = key(indices[i], axis);
+                    if ((value & mask) == prefix)
+                        histogram[(value >> shift) & 0xffff]++;
+                } });
+            std::size_t digit = 0;
+            for (;; digit++)
+            {
+                std::size_t count = 0;
+                for (auto const &histogram : histograms)
+                    count += histogram[digit];
+                if (rank < count)
+                    break;
+                rank -= count;
+            }
+            prefix |= std::uint64_t(digit) << shift;
+            mask |= std::uint64_t(0xffff) << shift;
+        }
+
+        // per-chunk counts of keys below the median give every chunk its output offsets
+        std::vector<std::size_t> below(numThreads + 1, 0);
+        parallel([&](unsigned int t, std::size_t begin, std::size_t end)
+                 {
+            std::size_t count = 0;
+            for (std::size_t i = begin; i < end; i++)
+                count += key(indices[i], axis) < prefix;
+            below[t + 1] = count; });
+        for (unsigned int t = 0; t < numThreads; t++)
+            below[t + 1] += below[t];
+
+        std::vector<int> scratch(n);
+        std::atomic<std::size_t> medianPos{0};
+        parallel([&](unsigned int t, std::size_t begin, std::size_t end)
+                 {
+            std::size_t low = below[t], high = k + begin - below[t];
+            for (std::size_t i = begin; i < end; i++)
+            {
+                const std::uint64_t value = key(indices[i], axis);
+                if (value < prefix)
+                    scratch[low++] = indices[i];
+                else
+                {
+                    if (value == prefix)
+                        medianPos = high;
+                    scratch[high++] = indices[i];
+                }
+            } });
+        std::swap(scratch[k], scratch[medianPos]);
+        parallel([&](unsigned int, std::size_t begin, std::size_t end)
+                 { std::copy(scratch.begin() + begin, scratch.begin() + end, indices + begin); });
+    }
+
+    // a point on a split plane may sit in either child
+    bool eraseRecursive(Point const &p, int index, std::size_t node, int begin, int end, int depth)
+    {
+        if (end - begin <= (int)m_bucketSize)
+        {
+            // leaves are sorted by index
+            auto it = std::lower_bound(m_indices.begin() + begin, m_indices.begin() + end, index);
+            const std::size_t i = it - m_indices.begin();
+            if (it == m_indices.begin() + end || *it != index || std::isinf(m_x[i]))
+                return false;
+            // the first erase from a restored tree copies the coordinates out of the mapping
+            m_x.owned()[i] = m_y.owned()[i] = m_z.owned()[i] = std::numeric_limits<float>::infinity();
+            return true;
+        }
+
+        const int mid = begin + (end - begin) / 2;
+        const float coordinate = p[depth % 3];
+        return (coordinate <= m_splits[node] && eraseRecursive(p, index, 2 * node + 1, begin, mid, depth + 1)) ||
+               (coordinate >= m_splits[node] && eraseRecursive(p, index, 2 * node + 2, mid, end, depth + 1));
+    }
+
+    /*
+     * The near child is always entered. With Boxes the far child is skipped when the split plane
+     * or its box is out of reach, without it by the split plane alone. visited counts the nodes entered.
+     */
+    template <bool Boxes, typename Visitor>
+    void forEachInRadiusRecursive(Point const &q, std::size_t node, int begin, int end, int depth, float limit, Visitor &visitor, std::size_t *visited = nullptr) const
+    {
+        if (visited != nullptr)
+            ++*visited;
+        if (end - begin <= (int)m_bucketSize)
+        {
+            float measures[maxBucketSize];
+            Metric::leaf(&m_x[begin], &m_y[begin], &m_z[begin], end - begin, q, measures);
+            for (int i = begin; i < end; i++)
+            {
+                if (measures[i - begin] < limit)
+                    visitor((std::size_t)m_indices[i], Point{m_x[i], m_y[i], m_z[i]}, measures[i - begin]);
+            }
+            return;
+        }
+
+        const int mid = begin + (end - begin) / 2;
+        const float diff = q[depth % 3] - m_splits[node];
+        if (diff < 0)
+            forEachInRadiusRecursive<Boxes>(q, 2 * node + 1, begin, mid, depth + 1, limit, visitor, visited);
+        else
+            forEachInRadiusRecursive<Boxes>(q, 2 * node + 2, mid, end, depth + 1, limit, visitor, visited);
+
+        // the far box lies beyond the split plane, so the plane is a cheaper first test
+        const std::size_t farNode = diff < 0 ? 2 * node + 2 : 2 * node + 1;
+        if (Metric::planeBound(diff) < limit && (!Boxes || boxBound(q, farNode) < limit))
+        {
+            if (diff < 0)
+                forEachInRadiusRecursive<Boxes>(q, farNode, mid, end, depth + 1, limit, visitor, visited);
+            else
+                forEachInRadiusRecursive<Boxes>(q, farNode, begin, mid, depth + 1, limit, visitor, visited);
+        }
+    }
+    bool anyInRadiusRecursive(Point const &q, std::size_t node, int begin, int end, int depth, float limit) const
+    {
+        if (end - begin <= (int)m_bucketSize)
+        {
+            float measures[maxBucketSize];
+            Metric::leaf(&m_x[begin], &m_y[begin], &m_z[begin], end - begin, q, measures);
+            for (int i = 0; i < end - begin; i++)
+            {
+                if (measures[i] < limit)
+                    return true;
+            }
+            return false;
+        }
+
+        const int mid = begin + (end - begin) / 2;
+        const float diff = q[depth % 3] - m_splits[node];
+        const bool farReachable = Metric::planeBound(diff) < limit;
+        if (diff < 0)
+            return anyInRadiusRecursive(q, 2 * node + 1, begin, mid, depth + 1, limit) ||
+                   (farReachable && boxBound(q, 2 * node + 2) < limit && anyInRadiusRecursive(q, 2 * node + 2, mid, end, depth + 1, limit));
+        return anyInRadiusRecursive(q, 2 * node + 2, mid, end, depth + 1, limit) ||
+               (farReachable && boxBound(q, 2 * node + 1) < limit && anyInRadiusRecursive(q, 2 * node + 1, begin, mid, depth + 1, limit));
+    }
+    // kNN for k = 1 with the radius as the initial bound, ties go to the smaller index
+    void nearestWithinRecursive(Point const &q, std::size_t node, int begin, int end, int depth, float &best, int &bestIdx) const
+    {
+        if (end - begin <= (int)m_bucketSize)
+        {
+            float measures[maxBucketSize];
+            Metric::leaf(&m_x[begin], &m_y[begin], &m_z[begin], end - begin, q, measures);
+            for (int i = 0; i < end - begin; i++)
+            {
+                if (measures[i] < best || (measures[i] == best && bestIdx >= 0 && m_indices[begin + i] < bestIdx))
+                {
+                    best = measures[i];
+                    bestIdx = m_indices[begin + i];
+                }
+            }
+            return;
+        }
+
+        const int mid = begin + (end - begin) / 2;
+        const float diff = q[depth % 3] - m_splits[node];
+        auto reachable = [&](float bound)
+        { return bound < best || (bestIdx >= 0 && bound == best); };
+        if (diff < 0)
+            nearestWithinRecursive(q, 2 * node + 1, begin, mid, depth + 1, best, bestIdx);
+        else
+            nearestWithinRecursive(q, 2 * node + 2, mid, end, depth + 1, best, bestIdx);
+        if (reachable(Metric::planeBound(diff)) && reachable(boxBound(q, diff < 0 ? 2 * node + 2 : 2 * node + 1)))
+        {
+            if (diff < 0)
+                nearestWithinRecursive(q, 2 * node + 2, mid, end, depth + 1, best, bestIdx);
+            else
+                nearestWithinRecursive(q, 2 * node + 1, begin, mid, depth + 1, best, bestIdx);
+        }
+    }
+    /*
+     * heap is a max-heap of the best candidates so far as (measure, index), at most k entries.
+     * With Boxes a subtree whose box ties the current k-th measure is still entered, so ties go to
+     * the smaller index; Boxes and visited are as in forEachInRadiusRecursive. Bounds are multiplied
+     * by scale before the comparison, which is above 1 for approximate searches, and pruned keeps
+     * the smallest bound of a skipped subtree.
+     */
+    template <bool Boxes>
+    void collectKNearestRecursive(Point const &q, std::size_t node, int begin, int end, int depth, std::vector<std::pair<float, int>> &heap, std::size_t k,
+                                  float scale = 1.0f, float *pruned = nullptr, std::size_t *visited = nullptr) const
+    {
+        if (visited != nullptr)
+            ++*visited;
+        if (end - begin <= (int)m_bucketSize)
+        {
+            float measures[maxBucketSize];
+            Metric::leaf(&m_x[begin], &m_y[begin], &m_z[begin], end - begin, q, measures);
+            for (int i = 0; i < end - begin; i++)
+            {
+                // erased points sit at infinity
+                if (!std::isfinite(measures[i]))
+                    continue;
+                std::pair<float, int> candidate(measures[i], m_indices[begin + i]);
+                if (heap.size() < k)
+                {
+                    heap.push_back(candidate);
+                    std::push_heap(heap.begin(), heap.end());
+                }
+                else if (candidate < heap.front())
+                {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = candidate;
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+            return;
+        }
+
+        const int mid = begin + (end - begin) / 2;
+        const float diff = q[depth % 3] - m_splits[node];
+        if (diff < 0)
+            collectKNearestRecursive<Boxes>(q, 2 * node + 1, begin, mid, depth + 1, heap, k, scale, pruned, visited);
+        else
+            collectKNearestRecursive<Boxes>(q, 2 * node + 2, mid, end, depth + 1, heap, k, scale, pruned, visited);
+        const std::size_t farNode = diff < 0 ? 2 * node + 2 : 2 * node + 1;
+        if (heap.size() == k)
+        {
+            float bound = Metric::planeBound(diff);
+            bool reachable = Boxes ? bound * scale <= heap.front().first : bound * scale < heap.front().first;
+            if (Boxes && reachable)
+            {
+                bound = boxBound(q, farNode);
+                reachable = bound * scale <= heap.front().first;
+            }
+            if (!reachable)
+            {
+                if (pruned != nullptr)
+                    *pruned = std::min(*pruned, bound);
+                return;
+            }
+        }
+        if (diff < 0)
+            collectKNearestRecursive<Boxes>(q, farNode, mid, end, depth + 1, heap, k, scale, pruned, visited);
+        else
+            collectKNearestRecursive<Boxes>(q, farNode, begin, mid, depth + 1, heap, k, scale, pruned, visited);
+    }
+    // queue holds the best candidates so far as (measure, index), sorted
+    void collectKNearestBaselineRecursive(Point const &q, std::size_t node, int begin, int end, int depth, std::vector<std::pair<float, int>> &queue, std::size_t k) const
+    {
+        if (end - begin <= (int)m_bucketSize)
+        {
+            float measures[maxBucketSize];
+            Metric::leaf(&m_x[begin], &m_y[begin], &m_z[begin], end - begin, q, measures);
+            for (int i = 0; i < end - begin; i++)
+            {
+                if (!std::isfinite(measures[i]))
+                    continue;
+                queue.push_back(std::make_pair(measures[i], m_indices[begin + i]));
+                std::sort(queue.begin(), queue.end());
+                if (queue.size() > k)
+                    queue.resize(k);
+            }
+            return;
+        }
+
+        const int mid = begin + (end - begin) / 2;
+        const float diff = q[depth % 3] - m_splits[node];
+        if (diff < 0)
+            collectKNearestBaselineRecursive(q, 2 * node + 1, begin, mid, depth + 1, queue, k);
+        else
+            collectKNearestBaselineRecursive(q, 2 * node + 2, mid, end, depth + 1, queue, k);
+        if (queue.size() < k || Metric::planeBound(diff) < queue.back().first)
+        {
+            if (diff < 0)
+                collectKNearestBaselineRecursive(q, 2 * node + 2, mid, end, depth + 1, queue, k);
+            else
+                collectKNearestBaselineRecursive(q, 2 * node + 1, begin, mid, depth + 1, queue, k);
+        }
+    }
+};
+
+using SpatialDataStructure = BasicSpatialDataStructure<SquaredEuclideanDistance>;
+
+/*
+ * Spatial index made of one SpatialDataStructure per batch of points. Chunks can be added
+ * while a file is streamed, queries visit every chunk whose bounding box can hold a result
+ * and report indices in insertion order across all chunks.
+ * Given a spill path, every chunk tree is appended to that file once it is built and only the
+ * chunk bounds stay in memory. Queries map the file and restore the trees they visit, keeping
+ * the residentChunks most recently used ones. The file is removed with the index.
+ * A chunk whose tree cannot be restored is left out of the query and marks the index as
+ * failed, so callers have to check failed() before trusting the results.
+ */
+class ChunkedSpatialIndex
+{
+public:
+    // a spill path in the temporary directory named per process and call, like MeshCache's temporary files
+    static std::string spillPathFor(std::string const &name)
+    {
+        static std::atomic<unsigned int> spills{0};
+        std::error_code ec;
+        return (std::filesystem::temp_directory_path(ec) / (name + ".tmp" + std::to_string(MeshCache::processId()) + "-" + std::to_string(spills++))).string();
+    }
+
+    explicit ChunkedSpatialIndex(std::string const &spillPath = "", std::size_t residentChunks = 8)
+        : m_spillPath(spillPath), m_residentChunks(std::max<std::size_t>(1, residentChunks))
+    {
+        if (!m_spillPath.empty())
+            std::ofstream(m_spillPath, std::ios::binary | std::ios::trunc);
+    }
+    ChunkedSpatialIndex(ChunkedSpatialIndex const &) = delete;
+    ChunkedSpatialIndex &operator=(ChunkedSpatialIndex const &) = delete;
+    ~ChunkedSpatialIndex()
+    {
+        if (!m_spillPath.empty())
+        {
+            m_mapped.close();
+            std::remove(m_spillPath.c_str());
+        }
+    }
+
+    // false if the chunk could not be written to the spill file, it is then left out
+    bool addChunk(PointList &&points)
+    {
+        if (points.empty())
+            return true;
+        Chunk chunk;
+        chunk.base = m_size;
+        chunk.count = points.size();
+        chunk.lo = chunk.hi = points[0];
+        for (Point const &p : points)
+        {
+            for (int d = 0; d < 3; d++)
+            {
+                chunk.lo[d] = std::min(chunk.lo[d], p[d]);
+                chunk.hi[d] = std::max(chunk.hi[d], p[d]);
+            }
+        }
+        auto tree = std::make_shared<const SpatialDataStructure>(std::move(points));
+        if (m_spillPath.empty())
+            chunk.tree = std::move(tree);
+        else if (!spill(*tree, chunk))
+            return false;
+        m_size += chunk.count;
+        m_chunks.push_back(std::move(chunk));
+        return true;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+    std::size_t chunkCount() const
+    {
+        return m_chunks.size();
+    }
+    // chunk trees held in memory right now
+    std::size_t residentCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_spillPath.empty() ? m_chunks.size() : m_resident.size();
+    }
+    // true once a chunk tree could not be restored from the spill file
+    bool failed() const
+    {
+        return m_failed.load(std::memory_order_relaxed);
+    }
+
+    // the origin, with failed() set, if the point's chunk cannot be restored
+    Point point(std::size_t idx) const
+    {
+        auto it = std::upper_bound(m_chunks.begin(), m_chunks.end(), idx, [](std::size_t i, Chunk const &c)
+                                   { return i < c.base; });
+        --it;
+        std::shared_ptr<const SpatialDataStructure> chunkTree = tree(*it);
+        return chunkTree ? chunkTree->point(idx - it->base) : Point{};
+    }
+
+    std::vector<std::size_t> collectInRadius(const Point &p, float radius) const
+    {
+        std::vector<std::size_t> result;
+        forEachInRadius(p, radius, [&](std::size_t idx, Point const &, float)
+                        { result.push_back(idx); });
+        return result;
+    }
+
+    bool anyInRadius(const Point &p, float radius) const
+    {
+        for (Chunk const &chunk : m_chunks)
+        {
+            if (boxDistance(chunk, p) >= radius)
+                continue;
+            std::shared_ptr<const SpatialDataStructure> chunkTree = tree(chunk);
+            if (chunkTree && chunkTree->anyInRadius(p, radius))
+                return true;
+        }
+        return false;
+    }
+
+    std::size_t countInRadius(const Point &p, float radius) const
+    {
+        std::size_t count = 0;
+        forEachInRadius(p, radius, [&](std::size_t, Point const &, float)
+                        { count++; });
+        return count;
+    }
+
+    // the nearest point closer than radius, false if there is none; ties go to the smaller index
+    bool nearestWithin(const Point &p, float radius, std::size_t *index, float *distance = nullptr) const
+    {
+        // chunks are visited in index order, so a later chunk only wins by being strictly closer
+        bool found = false;
+        for (Chunk const &chunk : m_chunks)
+        {
+            if (boxDistance(chunk, p) >= radius)
+                continue;
+            std::shared_ptr<const SpatialDataStructure> chunkTree = tree(chunk);
+            std::size_t local;
+            float d;
+            if (chunkTree && chunkTree->nearestWithin(p, radius, &local, &d))
+            {
+                *index = chunk.base + local;
+                radius = d;
+                found = true;
+            }
+        }
+        if (found && distance != nullptr)
+            *distance = radius;
+        return found;
+    }
+
+    // visitor(index, point, squared distance) for every point closer than radius, chunk by chunk
+    template <typename Visitor>
+    void forEachInRadius(const Point &p, float radius, Visitor &&visitor) const
+    {
+        for (Chunk const &chunk : m_chunks)
+        {
+            if (boxDistance(chunk, p) >= radius)
+                continue;
+            std::shared_ptr<const SpatialDataStructure> chunkTree = tree(chunk);
+            if (chunkTree)
+                chunkTree->forEachInRadius(p, radius, [&](std::size_t local, Point const &point, float squaredDistance)
+                                           { visitor(chunk.base + local, point, squaredDistance); });
+        }
+    }
+
+    std::vector<std::size_t> collectKNearest(const Point &p, unsigned int k, std::vector<float> *distances = nullptr) const
+    {
+        if (k == 0)
+        {
+            if (distances != nullptr)
+                distances->clear();
+            return {};
+        }
+        // nearest chunks first, so far chunks can be skipped once k candidates are known
+        std::vector<std::pair<float, std::size_t>> order;
+        for (std::size_t c = 0; c < m_chunks.size(); c++)
+            order.push_back(std::make_pair(boxDistance(m_chunks[c], p), c));
+        std::sort(order.begin(), order.end());
+
+        std::vector<std::pair<float, std::size_t>> best;
+        for (auto const &entry : order)
+        {
+            if (best.size() >= k && entry.first >= best.back().first)
+                break;
+            Chunk const &chunk = m_chunks[entry.second];
+            std::shared_ptr<const SpatialDataStructure> chunkTree = tree(chunk);
+            if (!chunkTree)
+                continue;
+            std::vector<float> distances;
+            std::vector<std::size_t> nearest = chunkTree->collectKNearest(p, k, &distances);
+            for (std::size_t i = 0; i < nearest.size(); i++)
+                best.push_back(std::make_pair(distances[i], chunk.base + nearest[i]));
+            std::sort(best.begin(), best.end());
+            if (best.size() > k)
+                best.resize(k);
+        }
+        std::vector<std::size_t> result;
+        for (auto const &entry : best)
+            result.push_back(entry.second);
+        if (distances != nullptr)
+        {
+            distances->clear();
+            for (auto const &entry : best)
+                distances->push_back(entry.first);
+        }
+        return result;
+    }
+
+    // collectInRadius for every query point, see runBatch
+    NeighborLists collectInRadiusBatch(ArrayView<Point> queries, float radius, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        return runBatch<char>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, char &)
+                              {
+            forEachInRadius(queries[q], radius, [&](std::size_t idx, Point const &, float squaredDistance)
+                            {
+                indices.push_back(idx);
+                if (distances != nullptr)
+                    distances->push_back(std::sqrt(squaredDistance)); }); });
+    }
+
+    // collectKNearest for every query point, see runBatch
+    NeighborLists collectKNearestBatch(ArrayView<Point> queries, unsigned int k, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        return runBatch<std::vector<float>>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, std::vector<float> &nearestDistances)
+                                            {
+            for (std::size_t idx : collectKNearest(queries[q], k, &nearestDistances))
+                indices.push_back(idx);
+            if (distances != nullptr)
+                distances->insert(distances->end(), nearestDistances.begin(), nearestDistances.end()); });
+    }
+
+private:
+    struct Chunk
+    {
+        // null while the tree only lives in the spill file
+        std::shared_ptr<const SpatialDataStructure> tree;
+        std::size_t base, count;
+        Point lo, hi;
+        // start of the tree's snapshot sections in the spill file and their element counts
+        std::uint64_t offset = 0;
+        std::array<std::uint64_t, 6> sections{};
+        std::size_t bucketSize = 0;
+    };
+    std::vector<Chunk> m_chunks;
+    std::size_t m_size = 0;
+    std::string m_spillPath;
+    std::size_t m_residentChunks;
+
+    // guards the mapping and the restored trees, which const queries fill in
+    mutable std::mutex m_mutex;
+    mutable MappedFile m_mapped;
+    // (chunk, tree), least recently used first
+    mutable std::vector<std::pair<std::size_t, std::shared_ptr<const SpatialDataStructure>>> m_resident;
+    mutable std::atomic<bool> m_failed{false};
+
+    bool spill(SpatialDataStructure const &tree, Chunk &chunk)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // the file is mapped again by the next query that needs it
+        m_mapped.close();
+        std::ofstream out(m_spillPath, std::ios::binary | std::ios::app);
+        out.seekp(0, std::ios::end);
+        chunk.offset = (std::uint64_t)out.tellp();
+        chunk.bucketSize = tree.bucketSize();
+        std::vector<MeshCache::Blob> blobs = tree.snapshotSections();
+        for (std::size_t i = 0; i < blobs.size(); i++)
+        {
+            out.write(static_cast<const char *>(blobs[i].data), blobs[i].count * blobs[i].elementSize);
+            chunk.sections[i] = blobs[i].count;
+        }
+        return (bool)out;
+    }
+
+    // the chunk's tree, restored from the spill file if it is not resident; null and failed() if that fails
+    std::shared_ptr<const SpatialDataStructure> tree(Chunk const &chunk) const
+    {
+        if (chunk.tree)
+            return chunk.tree;
+        const std::size_t c = &chunk - m_chunks.data();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (std::size_t i = 0; i < m_resident.size(); i++)
+        {
+            if (m_resident[i].first == c)
+            {
+                std::rotate(m_resident.begin() + i, m_resident.begin() + i + 1, m_resident.end());
+                return m_resident.back().second;
+            }
+        }
+
+        // every section holds 4-byte elements, so each one stays aligned behind the previous
+        std::uint64_t end = chunk.offset;
+        for (std::uint64_t count : chunk.sections)
+            end += count * 4;
+        if ((!m_mapped.isOpen() && !m_mapped.open(m_spillPath)) || end > m_mapped.size())
+        {
+            m_failed = true;
+            return nullptr;
+        }
+        const char *data = m_mapped.data() + chunk.offset;
+        ArrayView<float> arrays[5];
+        for (int i = 0; i < 5; i++)
+        {
+            arrays[i] = ArrayView<float>(reinterpret_cast<const float *>(data), chunk.sections[i]);
+            data += chunk.sections[i] * sizeof(float);
+        }
+        auto restored = std::make_shared<SpatialDataStructure>();
+        if (!restored->restore(arrays[0], arrays[1], arrays[2], arrays[3], arrays[4], ArrayView<int>(reinterpret_cast<const int *>(data), chunk.sections[5]),
+                               chunk.bucketSize))
+        {
+            m_failed = true;
+            return nullptr;
+        }
+        if (m_resident.size() >= m_residentChunks)
+            m_resident.erase(m_resident.begin());
+        m_resident.emplace_back(c, std::move(restored));
+        return m_resident.back().second;
+    }
+
+    static float boxDistance(Chunk const &chunk, Point const &p)
+    {
+        float d2 = 0.0f;
+        for (int d = 0; d < 3; d++)
+        {
+            float e = std::max({chunk.lo[d] - p[d], 0.0f, p[d] - chunk.hi[d]});
+            d2 += e * e;
+        }
+        return std::sqrt(d2);
+    }
+};
+
+/*
+ * Spatial index that takes insertions and erasures at a cost proportional to the change: a
+ * log-structured forest of SpatialDataStructures. New points collect in a buffer that queries scan
+ * linearly. A full buffer is merged with the trees of the lowest levels into one tree for the first
+ * level it fits, level i holding at most bufferSize * 2^i points, so a point takes part in
+ * O(log n) builds and a query visits O(log n) trees. Erased points are taken out of their tree
+ * (SpatialDataStructure::erase) and a tree is rebuilt from its remaining points once half of them
+ * are gone. Ids count the inserted points and are never reused.
+ */
+class DynamicSpatialIndex
+{
+public:
+    static constexpr std::size_t bufferSize = 256;
+
+    DynamicSpatialIndex() = default;
+
+    explicit DynamicSpatialIndex(PointList const &points)
+    {
+        insert(points);
+    }
+
+    // id of the new point
+    std::size_t insert(Point const &p)
+    {
+        return insert(ArrayView<Point>(&p, 1));
+    }
+
+    // the points get consecutive ids, the first one is returned
+    std::size_t insert(ArrayView<Point> points)
+    {
+        const std::size_t first = m_points.size();
+        for (std::size_t i = 0; i < points.size(); i++)
+        {
+            m_locations.push_back(Location{inBuffer, m_buffer.size()});
+            m_buffer.push_back(first + i);
+            m_points.push_back(points[i]);
+        }
+        m_size += points.size();
+        if (m_buffer.size() >= bufferSize)
+            flush();
+        return first;
+    }
+
+    // false if id was never inserted or is already erased
+    bool erase(std::size_t id)
+    {
+        if (id >= m_locations.size() || m_locations[id].level == erased)
+            return false;
+        const Location location = m_locations[id];
+        m_locations[id].level = erased;
+        m_size--;
+        if (location.level == inBuffer)
+        {
+            m_buffer[location.local] = m_buffer.back();
+            m_locations[m_buffer.back()].local = location.local;
+            m_buffer.pop_back();
+        }
+        else
+        {
+            Level &level = m_levels[location.level];
+            level.tree->erase(location.local);
+            if (2 * ++level.erased > level.ids.size())
+                rebuild(location.level, liveIds(level));
+        }
+        return true;
+    }
+
+    // points not erased
+    std::size_t size() const
+    {
+        return m_size;
+    }
+    bool contains(std::size_t id) const
+    {
+        return id < m_locations.size() && m_locations[id].level != erased;
+    }
+    // every point ever inserted, indexed by id
+    PointList const &getPoints() const
+    {
+        return m_points;
+    }
+    Point const &point(std::size_t id) const
+    {
+        return m_points[id];
+    }
+
+    std::vector<std::size_t> collectInRadius(const Point &p, float radius) const
+    {
+        std::vector<std::size_t> result;
+        forEachInRadius(p, radius, [&](std::size_t id, Point const &, float)
+                        { result.push_back(id); });
+        return result;
+    }
+
+    bool anyInRadius(const Point &p, float radius) const
+    {
+        const float limit = radius * radius;
+        for (std::size_t id : m_buffer)
+        {
+            if (SquaredEuclideanDistance::measure(m_points[id], p) < limit)
+                return true;
+        }
+        for (Level const &level : m_levels)
+        {
+            if (reaches(level, p, limit) && level.tree->anyInRadius(p, radius))
+                return true;
+        }
+        return false;
+    }
+
+    std::size_t countInRadius(const Point &p, float radius) const
+    {
+        std::size_t count = 0;
+        forEachInRadius(p, radius, [&](std::size_t, Point const &, float)
+                        { count++; });
+        return count;
+    }
+
+    // the nearest point closer than radius, false if there is none; ties go to the smaller id
+    bool nearestWithin(const Point &p, float radius, std::size_t *index, float *distance = nullptr) const
+    {
+        float best = radius * radius;
+        bool found = false;
+        auto offer = [&](std::size_t id, float squaredDistance)
+        {
+            if (squaredDistance < best || (found && squaredDistance == best && id < *index))
+            {
+                best = squaredDistance;
+                *index = id;
+                found = true;
+            }
+        };
+        for (std::size_t id : m_buffer)
+            offer(id, SquaredEuclideanDistance::measure(m_points[id], p));
+        for (Level const &level : m_levels)
+        {
+            std::size_t local;
+            // a level as far as the best point so far can still hold a tie with a smaller id
+            if (reaches(level, p, std::nextafter(best, std::numeric_limits<float>::infinity())) && level.tree->nearestWithin(p, radius, &local))
+                offer(level.ids[local], SquaredEuclideanDistance::measure(m_points[level.ids[local]], p));
+        }
+        if (found && distance != nullptr)
+            *distance = std::sqrt(best);
+        return found;
+    }
+
+    // visitor(id, point, squared distance) for every point closer than radius
+    template <typename Visitor>
+    void forEachInRadius(const Point &p, float radius, Visitor &&visitor) const
+    {
+        const float limit = radius * radius;
+        for (std::size_t id : m_buffer)
+        {
+            const float squaredDistance = SquaredEuclideanDistance::measure(m_points[id], p);
+            if (squaredDistance < limit)
+                visitor(id, m_points[id], squaredDistance);
+        }
+        for (Level const &level : m_levels)
+        {
+            if (reaches(level, p, limit))
+                level.tree->forEachInRadius(p, radius, [&](std::size_t local, Point const &point, float squaredDistance)
+                                            { visitor(level.ids[local], point, squaredDistance); });
+        }
+    }
+
+    // at most k ids sorted by distance, ties go to the smaller id
+    std::vector<std::size_t> collectKNearest(const Point &p, unsigned int k, std::vector<float> *distances = nullptr) const
+    {
+        std::vector<std::pair<float, std::size_t>> best;
+        collectKNearest(p, k, best);
+        std::vector<std::size_t> result(best.size());
+        for (std::size_t i = 0; i < best.size(); i++)
+            result[i] = best[i].second;
+        if (distances != nullptr)
+        {
+            distances->resize(best.size());
+            for (std::size_t i = 0; i < best.size(); i++)
+                (*distances)[i] = std::sqrt(best[i].first);
+        }
+        return result;
+    }
+
+    // collectInRadius for every query point, see runBatch
+    NeighborLists collectInRadiusBatch(ArrayView<Point> queries, float radius, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        return runBatch<char>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, char &)
+                              {
+            forEachInRadius(queries[q], radius, [&](std::size_t id, Point const &, float squaredDistance)
+                            {
+                indices.push_back(id);
+                if (distances != nullptr)
+                    distances->push_back(std::sqrt(squaredDistance)); }); });
+    }
+
+    // collectKNearest for every query point, see runBatch
+    NeighborLists collectKNearestBatch(ArrayView<Point> queries, unsigned int k, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        return runBatch<std::vector<std::pair<float, std::size_t>>>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, std::vector<std::pair<float, std::size_t>> &best)
+                                                                    {
+            collectKNearest(queries[q], k, best);
+            for (auto const &entry : best)
+            {
+                indices.push_back(entry.second);
+                if (distances != nullptr)
+                    distances->push_back(std::sqrt(entry.first));
+            } });
+    }
+
+private:
+    static constexpr std::size_t inBuffer = std::numeric_limits<std::size_t>::max();
+    static constexpr std::size_t erased = inBuffer - 1;
+
+    // level and position in that level's ids, or in the buffer
+    struct Location
+    {
+        std::size_t level;
+        std::size_t local;
+    };
+    // a tree over the points ids (tree index i is ids[i]) with their bounding box, erased of them taken out again
+    struct Level
+    {
+        std::unique_ptr<SpatialDataStructure> tree;
+        std::vector<std::size_t> ids;
+        std::size_t erased = 0;
+        Point lo, hi;
+    };
+
+    PointList m_points;
+    std::vector<Location> m_locations;
+    std::vector<std::size_t> m_buffer;
+    std::vector<Level> m_levels;
+    std::size_t m_size = 0;
+
+    std::vector<std::size_t> liveIds(Level const &level) const
+    {
+        std::vector<std::size_t> ids;
+        for (std::size_t id : level.ids)
+        {
+            if (m_locations[id].level != erased)
+                ids.push_back(id);
+        }
+        return ids;
+    }
+
+    // the buffer and the occupied levels below the first one the points fit into become that level
+    void flush()
+    {
+        std::vector<std::size_t> ids = std::move(m_buffer);
+        m_buffer.clear();
+        for (std::size_t level = 0;; level++)
+        {
+            if (level == m_levels.size())
+                m_levels.emplace_back();
+            for (std::size_t id : liveIds(m_levels[level]))
+                ids.push_back(id);
+            if (ids.size() <= bufferSize << level)
+            {
+                rebuild(level, std::move(ids));
+                return;
+            }
+            m_levels[level] = Level();
+        }
+    }
+
+    void rebuild(std::size_t index, std::vector<std::size_t> ids)
+    {
+        Level &level = m_levels[index];
+        level = Level();
+        if (ids.empty())
+            return;
+        // in id order the tree's ties, which go to the smaller local index, go to the smaller id
+        std::sort(ids.begin(), ids.end());
+        PointList points(ids.size());
+        level.lo = level.hi = m_points[ids[0]];
+        for (std::size_t i = 0; i < ids.size(); i++)
+        {
+            points[i] = m_points[ids[i]];
+            m_locations[ids[i]] = Location{index, i};
+            for (int axis = 0; axis < 3; axis++)
+            {
+                level.lo[axis] = std::min(level.lo[axis], points[i][axis]);
+                level.hi[axis] = std::max(level.hi[axis], points[i][axis]);
+            }
+        }
+        level.tree = std::make_unique<SpatialDataStructure>(std::move(points));
+        level.ids = std::move(ids);
+    }
+
+    // squared distance from p to the level's bounding box
+    static float boxDistance(Level const &level, Point const &p)
+    {
+        float d2 = 0.0f;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float e = std::max({level.lo[axis] - p[axis], 0.0f, p[axis] - level.hi[axis]});
+            d2 += e * e;
+        }
+        return d2;
+    }
+    // whether the level's tree can hold a point whose squared distance to p is below limit
+    static bool reaches(Level const &level, Point const &p, float limit)
+    {
+        return level.tree && boxDistance(level, p) < limit;
+    }
+
+    /*
+     * best holds (squared distance, id), sorted. Levels are searched nearest box first and the
+     * larger one first among overlapping boxes. Once k candidates are known the others only need
+     * a radius query up to the k-th of them. The buffer comes last, its scattered points would
+     * rarely tighten that bound.
+     */
+    void collectKNearest(const Point &p, unsigned int k, std::vector<std::pair<float, std::size_t>> &best) const
+    {
+        best.clear();
+        if (k == 0)
+            return;
+        // (box distance, level), at most one level per bit of the point count
+        std::pair<float, std::size_t> order[64];
+        std::size_t nLevels = 0;
+        for (std::size_t i = 0; i < m_levels.size(); i++)
+        {
+            if (m_levels[i].tree)
+                order[nLevels++] = std::make_pair(boxDistance(m_levels[i], p), i);
+        }
+        std::sort(order, order + nLevels, [](auto const &a, auto const &b)
+                  { return a.first < b.first || (a.first == b.first && a.second > b.second); });
+        for (std::size_t i = 0; i < nLevels; i++)
+        {
+            Level const *level = &m_levels[order[i].second];
+            if (best.size() < k)
+            {
+                for (std::size_t local : level->tree->collectKNearest(p, k))
+                {
+                    const std::size_t id = level->ids[local];
+                    best.emplace_back(SquaredEuclideanDistance::measure(m_points[id], p), id);
+                }
+                continue;
+            }
+            std::nth_element(best.begin(), best.begin() + (k - 1), best.end());
+            best.resize(k);
+            // points as far as the k-th candidate can still win on the smaller id
+            const float bound = best[k - 1].first;
+            if (!reaches(*level, p, std::nextafter(bound, std::numeric_limits<float>::infinity())))
+                continue;
+            const float radius = std::nextafter(std::sqrt(bound), std::numeric_limits<float>::infinity());
+            level->tree->forEachInRadius(p, radius, [&](std::size_t local, Point const &, float squaredDistance)
+                                         {
+                if (squaredDistance <= bound)
+                    best.emplace_back(squaredDistance, level->ids[local]); });
+        }
+        for (std::size_t id : m_buffer)
+            best.emplace_back(SquaredEuclideanDistance::measure(m_points[id], p), id);
+        const std::size_t n = std::min<std::size_t>(k, best.size());
+        std::partial_sort(best.begin(), best.begin() + n, best.end());
+        best.resize(n);
+    }
+};
+
+/*
+ * Compact point store: positions quantized to 16 bits per axis inside the bounding box and
+ * normals octahedral-encoded into 32 bits, 10 bytes per point instead of 24. Points are
+ * decoded on access, the quantization error is at most half a step (extent / 65535) per axis.
+ */
+class QuantizedPointList
+{
+public:
+    QuantizedPointList() = default;
+    QuantizedPointList(PointList const &points, std::vector<Normal> const *normals = nullptr)
+    {
+        if (points.empty())
+            return;
+        Point hi = points[0];
+        m_lo = points[0];
+        for (Point const &p : points)
+        {
+            for (int d = 0; d < 3; d++)
+            {
+                m_lo[d] = std::min(m_lo[d], p[d]);
+                hi[d] = std::max(hi[d], p[d]);
+            }
+        }
+        for (int d = 0; d < 3; d++)
+            m_step[d] = hi[d] > m_lo[d] ? (hi[d] - m_lo[d]) / 65535.0f : 1.0f;
+
+        m_positions.resize(points.size());
+        for (std::size_t i = 0; i < points.size(); i++)
+        {
+            for (int d = 0; d < 3; d++)
+            {
+                float q = std::round((points[i][d] - m_lo[d]) / m_step[d]);
+                m_positions[i][d] = (std::uint16_t)std::clamp(q, 0.0f, 65535.0f);
+            }
+        }
+        if (normals != nullptr && normals->size() == points.size())
+        {
+            m_normals.resize(normals->size());
+            for (std::size_t i = 0; i < normals->size(); i++)
+                m_normals[i] = encodeNormal((*normals)[i]);
+        }
+    }
+
+    std::size_t size() const
+    {
+        return m_positions.size();
+    }
+    bool hasNormals() const
+    {
+        return !m_normals.empty();
+    }
+    std::size_t memoryBytes() const
+    {
+        return m_positions.size() * sizeof(m_positions[0]) + m_normals.size() * sizeof(m_normals[0]);
+    }
+
+    Point point(std::size_t i) const
+    {
+        const std::array<std::uint16_t, 3> &q = m_positions[i];
+        return Point{m_lo[0] + q[0] * m_step[0], m_lo[1] + q[1] * m_step[1], m_lo[2] + q[2] * m_step[2]};
+    }
+    // unit length
+    Normal normal(std::size_t i) const
+    {
+        return decodeNormal(m_normals[i]);
+    }
+    std::uint16_t quantized(std::size_t i, int axis) const
+    {
+        return m_positions[i][axis];
+    }
+    // point(i) is origin() + quantized(i) * step() per axis
+    Point const &origin() const
+    {
+        return m_lo;
+    }
+    std::array<float, 3> const &step() const
+    {
+        return m_step;
+    }
+
+    static std::uint32_t encodeNormal(Normal const &n)
+    {
+        const float l1 = std::fabs(n[0]) + std::fabs(n[1]) + std::fabs(n[2]);
+        if (l1 == 0.0f)
+            return encodeUnit(0.0f, 0.0f);
+        float x = n[0] / l1, y = n[1] / l1;
+        if (n[2] < 0.0f)
+        {
+            const float ox = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+            const float oy = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+            x = ox;
+            y = oy;
+        }
+        return encodeUnit(x, y);
+    }
+    static Normal decodeNormal(std::uint32_t code)
+    {
+        float x = (code & 0xffff) / 65535.0f * 2.0f - 1.0f;
+        float y = (code >> 16) / 65535.0f * 2.0f - 1.0f;
+        const float z = 1.0f - std::fabs(x) - std::fabs(y);
+        if (z < 0.0f)
+        {
+            const float ox = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+            const float oy = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+            x = ox;
+            y = oy;
+        }
+        const float length = std::sqrt(x * x + y * y + z * z);
+        return Normal{x / length, y / length, z / length};
+    }
+
+private:
+    Point m_lo{0.0f, 0.0f, 0.0f};
+    std::array<float, 3> m_step{1.0f, 1.0f, 1.0f};
+    std::vector<std::array<std::uint16_t, 3>> m_positions;
+    std::vector<std::uint32_t> m_normals;
+
+    static std::uint32_t encodeUnit(float x, float y)
+    {
+        const std::uint32_t u = (std::uint32_t)std::lround((std::clamp(x, -1.0f, 1.0f) * 0.5f + 0.5f) * 65535.0f);
+        const std::uint32_t v = (std::uint32_t)std::lround((std::clamp(y, -1.0f, 1.0f) * 0.5f + 0.5f) * 65535.0f);
+        return u | (v << 16);
+    }
+};
+
+/*
+ * squaredDistances for 16-bit coordinates, each decoded as origin + coordinate * step first, so the
+ * results are the squared distances to the points QuantizedPointList::point returns (up to the
+ * rounding of a fused multiply-add the compiler may use for either)
+ */
+inline void quantizedSquaredDistances(const std::uint16_t *xs, const std::uint16_t *ys, const std::uint16_t *zs, std::size_t n, Point const &origin,
+                                      std::array<float, 3> const &step, Point const &q, float *out)
+{
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    const __m256 ox8 = _mm256_set1_ps(origin[0]), oy8 = _mm256_set1_ps(origin[1]), oz8 = _mm256_set1_ps(origin[2]);
+    const __m256 sx8 = _mm256_set1_ps(step[0]), sy8 = _mm256_set1_ps(step[1]), sz8 = _mm256_set1_ps(step[2]);
+    const __m256 qx8 = _mm256_set1_ps(q[0]), qy8 = _mm256_set1_ps(q[1]), qz8 = _mm256_set1_ps(q[2]);
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(xs + i))));
+        const __m256 y = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ys + i))));
+        const __m256 z = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(zs + i))));
+        const __m256 dx = _mm256_sub_ps(_mm256_add_ps(ox8, _mm256_mul_ps(x, sx8)), qx8);
+        const __m256 dy = _mm256_sub_ps(_mm256_add_ps(oy8, _mm256_mul_ps(y, sy8)), qy8);
+        const __m256 dz = _mm256_sub_ps(_mm256_add_ps(oz8, _mm256_mul_ps(z, sz8)), qz8);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+    const __m128 ox4 = _mm_set1_ps(origin[0]), oy4 = _mm_set1_ps(origin[1]), oz4 = _mm_set1_ps(origin[2]);
+    const __m128 sx4 = _mm_set1_ps(step[0]), sy4 = _mm_set1_ps(step[1]), sz4 = _mm_set1_ps(step[2]);
+    const __m128 qx4 = _mm_set1_ps(q[0]), qy4 = _mm_set1_ps(q[1]), qz4 = _mm_set1_ps(q[2]);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4)
+    {
+        // widening the four 16-bit values with zeros needs only SSE2
+        const __m128 x = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(xs + i)), zero));
+        const __m128 y = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(ys + i)), zero));
+        const __m128 z = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(zs + i)), zero));
+        const __m128 dx = _mm_sub_ps(_mm_add_ps(ox4, _mm_mul_ps(x, sx4)), qx4);
+        const __m128 dy = _mm_sub_ps(_mm_add_ps(oy4, _mm_mul_ps(y, sy4)), qy4);
+        const __m128 dz = _mm_sub_ps(_mm_add_ps(oz4, _mm_mul_ps(z, sz4)), qz4);
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        const float dx = origin[0] + xs[i] * step[0] - q[0], dy = origin[1] + ys[i] * step[1] - q[1], dz = origin[2] + zs[i] * step[2] - q[2];
+        out[i] = dx * dx + dy * dy + dz * dz;
+    }
+}
+
+/*
+ * kd-tree over positions quantized as in QuantizedPointList, laid out like SpatialDataStructure:
+ * ranges of at most bucketSize points are leaves, split values and node boxes are kept in heap
+ * order, and the 16-bit coordinates are stored per axis in tree order, so a leaf is decoded and
+ * measured by one quantizedSquaredDistances call over consecutive memory. A point costs 6 bytes of
+ * coordinates and a 4-byte index into the input list, plus its share of the splits and boxes.
+ * Distances are those to the decoded points, indices refer to the order of the input list.
+ */
+class QuantizedSpatialIndex
+{
+public:
+    static constexpr std::size_t maxBucketSize = 64;
+
+    QuantizedSpatialIndex(PointList const &points, std::size_t bucketSize = 32)
+        : m_bucketSize(std::clamp<std::size_t>(bucketSize, 1, maxBucketSize))
+    {
+        const QuantizedPointList store(points);
+        m_origin = store.origin();
+        m_step = store.step();
+        std::vector<std::uint32_t> order(points.size());
+        std::iota(order.begin(), order.end(), 0u);
+        m_splits.assign(SpatialDataStructure::splitCount(points.size(), 0, m_bucketSize), 0.0f);
+        build(store, order.data(), (std::uint32_t)order.size(), 0, 0);
+        m_x.resize(order.size());
+        m_y.resize(order.size());
+        m_z.resize(order.size());
+        for (std::size_t i = 0; i < order.size(); i++)
+        {
+            m_x[i] = store.quantized(order[i], 0);
+            m_y[i] = store.quantized(order[i], 1);
+            m_z[i] = store.quantized(order[i], 2);
+        }
+        m_indices = std::move(order);
+        m_boxes.assign(6 * SpatialDataStructure::boxCount(points.size(), 0, m_bucketSize), 0.0f);
+        if (!m_indices.empty())
+            buildBoxes(0, 0, (std::uint32_t)m_indices.size());
+    }
+
+    std::size_t size() const
+    {
+        return m_indices.size();
+    }
+    // coordinates, indices, splits and boxes
+    std::size_t memoryBytes() const
+    {
+        return (m_x.size() + m_y.size() + m_z.size()) * sizeof(std::uint16_t) + m_indices.size() * sizeof(std::uint32_t) +
+               (m_splits.size() + m_boxes.size()) * sizeof(float);
+    }
+
+    std::vector<std::size_t> collectInRadius(const Point &p, float radius) const
+    {
+        std::vector<std::size_t> result;
+        forEachInRadius(p, radius, [&](std::size_t idx, Point const &, float)
+                        { result.push_back(idx); });
+        return result;
+    }
+
+    // visitor(index, decoded point, squared distance) for every point closer than radius
+    template <typename Visitor>
+    void forEachInRadius(const Point &p, float radius, Visitor &&visitor) const
+    {
+        if (!m_indices.empty())
+            forEachInRadiusRecursive(p, 0, 0, (std::uint32_t)m_indices.size(), 0, radius * radius, visitor);
+    }
+
+    // collectInRadius for every query point, see runBatch
+    NeighborLists collectInRadiusBatch(ArrayView<Point> queries, float radius, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        return runBatch<char>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, char &)
+                              {
+            auto collect = [&](std::size_t idx, Point const &, float squaredDistance)
+            {
+                indices.push_back(idx);
+                if (distances != nullptr)
+                    distances->push_back(std::sqrt(squaredDistance));
+            };
+            forEachInRadius(queries[q], radius, collect); });
+    }
+
+    std::vector<std::size_t> collectKNearest(const Point &p, unsigned int k, std::vector<float> *distances = nullptr) const
+    {
+        std::vector<std::pair<float, std::uint32_t>> heap;
+        heap.reserve(std::min<std::size_t>(k, m_indices.size()));
+        if (k > 0 && !m_indices.empty())
+            collectKNearestRecursive(p, 0, 0, (std::uint32_t)m_indices.size(), 0, heap, k);
+        std::sort_heap(heap.begin(), heap.end());
+
+        std::vector<std::size_t> result(heap.size());
+        for (std::size_t i = 0; i < heap.size(); i++)
+            result[i] = heap[i].second;
+        if (distances != nullptr)
+        {
+            distances->resize(heap.size());
+            for (std::size_t i = 0; i < heap.size(); i++)
+                (*distances)[i] = std::sqrt(heap[i].first);
+        }
+        return result;
+    }
+
+private:
+    std::size_t m_bucketSize;
+    Point m_origin{0.0f, 0.0f, 0.0f};
+    std::array<float, 3> m_step{1.0f, 1.0f, 1.0f};
+    std::vector<float> m_splits;
+    // per node the minimum x, y, z and then the maximum x, y, z of its decoded points
+    std::vector<float> m_boxes;
+    std::vector<std::uint16_t> m_x, m_y, m_z;
+    std::vector<std::uint32_t> m_indices;
+
+    float decode(std::uint16_t coordinate, int axis) const
+    {
+        return m_origin[axis] + coordinate * m_step[axis];
+    }
+    float boxBound(Point const &q, std::size_t node) const
+    {
+        const float *box = &m_boxes[6 * node];
+        const float dx = std::max(std::max(box[0] - q[0], q[0] - box[3]), 0.0f);
+        const float dy = std::max(std::max(box[1] - q[1], q[1] - box[4]), 0.0f);
+        const float dz = std::max(std::max(box[2] - q[2], q[2] - box[5]), 0.0f);
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    // median splits on the quantized coordinates, ties broken by index
+    void build(QuantizedPointList const &store, std::uint32_t *order, std::uint32_t npoints, int depth, std::size_t node)
+    {
+        if (npoints <= m_bucketSize)
+            return;
+        const int axis = depth % 3;
+        const std::uint32_t mid = npoints / 2;
+        std::nth_element(order, order + mid, order + npoints, [&](std::uint32_t lhs, std::uint32_t rhs)
+                         { return std::make_pair(store.quantized(lhs, axis), lhs) < std::make_pair(store.quantized(rhs, axis), rhs); });
+        m_splits[node] = store.point(order[mid])[axis];
+        build(store, order, mid, depth + 1, 2 * node + 1);
+        build(store, order + mid, npoints - mid, depth + 1, 2 * node + 2);
+    }
+    void buildBoxes(std::size_t node, std::uint32_t begin, std::uint32_t end)
+    {
+        float *box = &m_boxes[6 * node];
+        if (end - begin <= m_bucketSize)
+        {
+            std::uint16_t lo[3] = {m_x[begin], m_y[begin], m_z[begin]}, hi[3] = {m_x[begin], m_y[begin], m_z[begin]};
+            for (std::uint32_t i = begin + 1; i < end; i++)
+            {
+                const std::uint16_t c[3] = {m_x[i], m_y[i], m_z[i]};
+                for (int d = 0; d < 3; d++)
+                {
+                    lo[d] = std::min(lo[d], c[d]);
+                    hi[d] = std::max(hi[d], c[d]);
+                }
+            }
+            for (int d = 0; d < 3; d++)
+            {
+                box[d] = decode(lo[d], d);
+                box[3 + d] = decode(hi[d], d);
+            }
+            return;
+        }
+        const std::uint32_t mid = begin + (end - begin) / 2;
+        buildBoxes(2 * node + 1, begin, mid);
+        buildBoxes(2 * node + 2, mid, end);
+        const float *left = &m_boxes[6 * (2 * node + 1)], *right = &m_boxes[6 * (2 * node + 2)];
+        for (int d = 0; d < 3; d++)
+        {
+            box[d] = std::min(left[d], right[d]);
+            box[3 + d] = std::max(left[3 + d], right[3 + d]);
+        }
+    }
+
+    template <typename Visitor>
+    void forEachInRadiusRecursive(const Point &q, std::size_t node, std::uint32_t begin, std::uint32_t end, int depth, float radius2, Visitor &visitor) const
+    {
+        if (end - begin <= m_bucketSize)
+        {
+            float measures[maxBucketSize];
+            quantizedSquaredDistances(&m_x[begin], &m_y[begin], &m_z[begin], end - begin, m_origin, m_step, q, measures);
+            for (std::uint32_t i = begin; i < end; i++)
+            {
+                if (measures[i - begin] < radius2)
+                    visitor((std::size_t)m_indices[i], Point{decode(m_x[i], 0), decode(m_y[i], 1), decode(m_z[i], 2)}, measures[i - begin]);
+            }
+            return;
+        }
+
+        const std::uint32_t mid = begin + (end - begin) / 2;
+        const float diff = q[depth % 3] - m_splits[node];
+        if (diff < 0)
+            forEachInRadiusRecursive(q, 2 * node + 1, begin, mid, depth + 1, radius2, visitor);
+        else
+            forEachInRadiusRecursive(q, 2 * node + 2, mid, end, depth + 1, radius2, visitor);
+        const std::size_t farNode = diff < 0 ? 2 * node + 2 : 2 * node + 1;
+        if (diff * diff < radius2 && boxBound(q, farNode) < radius2)
+        {
+            if (diff < 0)
+                forEachInRadiusRecursive(q, farNode, mid, end, depth + 1, radius2, visitor);
+            else
+                forEachInRadiusRecursive(q, farNode, begin, mid, depth + 1, radius2, visitor);
+        }
+    }
+
+    void collectKNearestRecursive(const Point &q, std::size_t node, std::uint32_t begin, std::uint32_t end, int depth, std::vector<std::pair<float, std::uint32_t>> &heap,
+                                  std::size_t k) const
+    {
+        if (end - begin <= m_bucketSize)
+        {
+            float measures[maxBucketSize];
+            quantizedSquaredDistances(&m_x[begin], &m_y[begin], &m_z[begin], end - begin, m_origin, m_step, q, measures);
+            for (std::uint32_t i = 0; i < end - begin; i++)
+            {
+                std::pair<float, std::uint32_t> candidate(measures[i], m_indices[begin + i]);
+                if (heap.size() < k)
+                {
+                    heap.push_back(candidate);
+                    std::push_heap(heap.begin(), heap.end());
+                }
+                else if (candidate < heap.front())
+                {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = candidate;
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+            return;
+        }
+
+        const std::uint32_t mid = begin + (end - begin) / 2;
+        const float diff = q[depth % 3] - m_splits[node];
+        if (diff < 0)
+            collectKNearestRecursive(q, 2 * node + 1, begin, mid, depth + 1, heap, k);
+        else
+            collectKNearestRecursive(q, 2 * node + 2, mid, end, depth + 1, heap, k);
+        const std::size_t farNode = diff < 0 ? 2 * node + 2 : 2 * node + 1;
+        if (heap.size() == k && (diff * diff > heap.front().first || boxBound(q, farNode) > heap.front().first))
+            return;
+        if (diff < 0)
+            collectKNearestRecursive(q, farNode, mid, end, depth + 1, heap, k);
+        else
+            collectKNearestRecursive(q, farNode, begin, mid, depth + 1, heap, k);
+    }
+};
+
+/*
+ * Uniform grid over the points for queries of about one radius, stored as a spatial hash of cell
+ * rows: the rows of cells along x are hashed into a table of at least as many buckets as points and
+ * a bucket holds its points sorted by cell, so the cells of one row that a query overlaps are a
+ * single run. Cells have an edge of twice the radius, a query ball then touches at most two cells
+ * per axis and reads at most four runs. Other radii work but scan more cells or more points. Same
+ * interface as SpatialDataStructure, squared Euclidean distances only.
+ */
+class UniformGridIndex
+{
+public:
+    UniformGridIndex(PointList const &points, float radius)
+        : m_points(points)
+    {
+        build(radius);
+    }
+
+    UniformGridIndex(PointList &&points, float radius)
+        : m_points(std::move(points))
+    {
+        build(radius);
+    }
+
+    PointList const &getPoints() const
+    {
+        return m_points;
+    }
+    Point const &point(std::size_t i) const
+    {
+        return m_points[i];
+    }
+    float cellSize() const
+    {
+        return m_cellSize;
+    }
+
+    float radius() const
+    {
+        return m_radius;
+    }
+    // rebuilds the grid for another query radius
+    void setRadius(float radius)
+    {
+        if (radius != m_radius)
+            build(radius);
+    }
+
+    std::vector<std::size_t> collectInRadius(const Point &p, float radius) const
+    {
+        std::vector<std::size_t> result;
+        forEachInRadius(p, radius, [&](std::size_t idx, Point const &, float)
+                        { result.push_back(idx); });
+        return result;
+    }
+
+    bool anyInRadius(const Point &p, float radius) const
+    {
+        const float limit = radius * radius;
+        bool found = false;
+        forEachRunInRadius(p, radius, [&](std::size_t begin, std::size_t end)
+                           {
+            for (std::size_t j = begin; j < end && !found; j++)
+                found = squaredDistance(p, j) < limit;
+            return !found; });
+        return found;
+    }
+
+    std::size_t countInRadius(const Point &p, float radius) const
+    {
+        std::size_t count = 0;
+        forEachInRadius(p, radius, [&](std::size_t, Point const &, float)
+                        { count++; });
+        return count;
+    }
+
+    // the nearest point closer than radius, false if there is none
+    bool nearestWithin(const Point &p, float radius, std::size_t *index, float *distance = nullptr) const
+    {
+        float best = radius * radius;
+        int bestIdx = -1;
+        forEachInRadius(p, radius, [&](std::size_t idx, Point const &, float squaredDistance)
+                        {
+            if (squaredDistance < best || (squaredDistance == best && (int)idx < bestIdx))
+            {
+                best = squaredDistance;
+                bestIdx = (int)idx;
+            } });
+        if (bestIdx < 0)
+            return false;
+        *index = bestIdx;
+        if (distance != nullptr)
+            *distance = std::sqrt(best);
+        return true;
+    }
+
+    // visitor(index, point, squared distance) for every point closer than radius
+    template <typename Visitor>
+    void forEachInRadius(const Point &p, float radius, Visitor &&visitor) const
+    {
+        const float limit = radius * radius;
+        forEachRunInRadius(p, radius, [&](std::size_t begin, std::size_t end)
+                           {
+            float measures[chunkSize];
+            for (std::size_t first = begin; first < end; first += chunkSize)
+            {
+                const std::size_t n = std::min(chunkSize, end - first);
+                squaredDistances(&m_x[first], &m_y[first], &m_z[first], n, p, measures);
+                for (std::size_t i = 0; i < n; i++)
+                {
+                    if (measures[i] < limit)
+                        visitor((std::size_t)m_indices[first + i], m_points[m_indices[first + i]], measures[i]);
+                }
+            }
+            return true; });
+    }
+
+    // at most k indices sorted by distance, ties go to the smaller index
+    std::vector<std::size_t> collectKNearest(const Point &p, unsigned int k, std::vector<float> *distances = nullptr) const
+    {
+        std::vector<std::pair<float, int>> heap;
+        collectKNearest(p, k, heap);
+        std::vector<std::size_t> result(heap.size());
+        for (std::size_t i = 0; i < heap.size(); i++)
+            result[i] = heap[i].second;
+        if (distances != nullptr)
+        {
+            distances->resize(heap.size());
+            for (std::size_t i = 0; i < heap.size(); i++)
+                (*distances)[i] = std::sqrt(heap[i].first);
+        }
+        return result;
+    }
+
+    // collectInRadius for every query point, see runBatch
+    NeighborLists collectInRadiusBatch(ArrayView<Point> queries, float radius, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        return runBatch<char>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, char &)
+                              {
+            forEachInRadius(queries[q], radius, [&](std::size_t idx, Point const &, float squaredDistance)
+                            {
+                indices.push_back(idx);
+                if (distances != nullptr)
+                    distances->push_back(std::sqrt(squaredDistance)); }); });
+    }
+
+    // collectKNearest for every query point, see runBatch
+    NeighborLists collectKNearestBatch(ArrayView<Point> queries, unsigned int k, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        return runBatch<std::vector<std::pair<float, int>>>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, std::vector<std::pair<float, int>> &heap)
+                                                            {
+            collectKNearest(queries[q], k, heap);
+            for (auto const &entry : heap)
+            {
+                indices.push_back(entry.second);
+                if (distances != nullptr)
+                    distances->push_back(std::sqrt(entry.first));
+            } });
+    }
+
+private:
+    // at most 2^20 cells per axis, so that a cell fits into 60 bits
+    static constexpr int maxCellsPerAxis = 1 << 20;
+    static constexpr std::size_t chunkSize = 64;
+
+    PointList m_points;
+    float m_radius = 0, m_cellSize = 0, m_inverseCellSize = 0;
+    Point m_origin{0, 0, 0};
+    int m_dims[3] = {1, 1, 1};
+    std::uint32_t m_mask = 0;
+    // bucket b holds the entries m_start[b] ... m_start[b + 1] - 1, sorted by m_cells and then by index
+    std::vector<std::uint32_t> m_start;
+    std::vector<float> m_x, m_y, m_z;
+    std::vector<std::uint64_t> m_cells;
+    std::vector<int> m_indices;
+
+    void build(float radius)
+    {
+        m_radius = radius;
+        Point lo{0, 0, 0}, hi{0, 0, 0};
+        if (!m_points.empty())
+            lo = hi = m_points[0];
+        for (Point const &p : m_points)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                lo[axis] = std::min(lo[axis], p[axis]);
+                hi[axis] = std::max(hi[axis], p[axis]);
+            }
+        }
+        const float extent = std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+        m_cellSize = std::max(2 * radius, extent / (maxCellsPerAxis - 1));
+        if (!(m_cellSize > 0))
+            m_cellSize = 1;
+        m_inverseCellSize = 1 / m_cellSize;
+        m_origin = lo;
+        for (int axis = 0; axis < 3; axis++)
+            m_dims[axis] = std::min(maxCellsPerAxis, (int)((hi[axis] - lo[axis]) * m_inverseCellSize) + 1);
+
+        std::uint32_t tableSize = 1;
+        while (tableSize < m_points.size())
+            tableSize *= 2;
+        m_mask = tableSize - 1;
+
+        // points sorted by cell and index, then stably distributed to the buckets of their rows
+        const std::size_t n = m_points.size();
+        std::vector<std::pair<std::uint64_t, int>> sorted(n);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            int c[3];
+            for (int axis = 0; axis < 3; axis++)
+                c[axis] = cellCoordinate(m_points[i][axis], axis);
+            sorted[i] = std::make_pair(packCell(c[0], c[1], c[2]), (int)i);
+        }
+        std::sort(sorted.begin(), sorted.end());
+        m_start.assign(tableSize + 1, 0);
+        for (auto const &entry : sorted)
+            m_start[rowBucket(entry.first) + 1]++;
+        for (std::uint32_t b = 0; b < tableSize; b++)
+            m_start[b + 1] += m_start[b];
+
+        std::vector<std::uint32_t> next(m_start.begin(), m_start.end() - 1);
+        m_x.resize(n);
+        m_y.resize(n);
+        m_z.resize(n);
+        m_cells.resize(n);
+        m_indices.resize(n);
+        for (auto const &[cell, i] : sorted)
+        {
+            const std::uint32_t j = next[rowBucket(cell)]++;
+            m_x[j] = m_points[i][0];
+            m_y[j] = m_points[i][1];
+            m_z[j] = m_points[i][2];
+            m_cells[j] = cell;
+            m_indices[j] = i;
+        }
+    }
+
+    int cellCoordinate(float v, int axis) const
+    {
+        return (int)std::clamp(std::floor((v - m_origin[axis]) * m_inverseCellSize), 0.0f, (float)(m_dims[axis] - 1));
+    }
+    // x in the low bits, so that the cells of a row are consecutive
+    static std::uint64_t packCell(int x, int y, int z)
+    {
+        return (std::uint64_t)x | ((std::uint64_t)y << 20) | ((std::uint64_t)z << 40);
+    }
+    std::uint32_t rowBucket(std::uint64_t cell) const
+    {
+        const std::uint32_t y = (std::uint32_t)(cell >> 20) & 0xfffff, z = (std::uint32_t)(cell >> 40);
+        return ((y * 73856093u) ^ (z * 19349663u)) & m_mask;
+    }
+    float squaredDistance(Point const &p, std::size_t j) const
+    {
+        const float dx = m_x[j] - p[0], dy = m_y[j] - p[1], dz = m_z[j] - p[2];
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    // calls runVisitor(begin, end) for the entries of the cells x0 ... x1 of row (y, z) unless they are empty
+    template <typename RunVisitor>
+    bool visitRow(int x0, int x1, int y, int z, RunVisitor &runVisitor) const
+    {
+        const std::uint64_t first = packCell(x0, y, z);
+        const std::uint32_t b = rowBucket(first);
+        if (m_start[b] == m_start[b + 1])
+            return true;
+        // buckets hold few rows of few cells, a linear scan is cheaper than a binary search
+        const std::uint64_t last = packCell(x1, y, z);
+        std::size_t begin = m_start[b];
+        const std::size_t bucketEnd = m_start[b + 1];
+        while (begin < bucketEnd && m_cells[begin] < first)
+            begin++;
+        std::size_t end = begin;
+        while (end < bucketEnd && m_cells[end] <= last)
+            end++;
+        return begin == end || runVisitor(begin, end);
+    }
+
+    /*
+     * Calls runVisitor(begin, end) for every run of entries in the cells overlapping the cube of half
+     * edge radius around p, until it returns false. With more rows to look up than points the whole
+     * grid is passed as one run instead.
+     */
+    template <typename RunVisitor>
+    void forEachRunInRadius(const Point &p, float radius, RunVisitor &&runVisitor) const
+    {
+        if (m_points.empty() || !(radius > 0))
+            return;
+        int lo[3], hi[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float from = (p[axis] - radius - m_origin[axis]) * m_inverseCellSize;
+            const float to = (p[axis] + radius - m_origin[axis]) * m_inverseCellSize;
+            if (to < 0 || from >= m_dims[axis])
+                return;
+            // clamped while still float, a large radius would overflow int; truncation rounds down
+            lo[axis] = from > 0 ? (int)from : 0;
+            hi[axis] = (int)std::min<float>(to, (float)(m_dims[axis] - 1));
+        }
+        if ((double)(hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1) > (double)m_points.size())
+        {
+            runVisitor(0, m_indices.size());
+            return;
+        }
+        for (int z = lo[2]; z <= hi[2]; z++)
+        {
+            for (int y = lo[1]; y <= hi[1]; y++)
+            {
+                if (!visitRow(lo[0], hi[0], y, z, runVisitor))
+                    return;
+            }
+        }
+    }
+
+    // sorted (squared distance, index) pairs of the k nearest points, searching shells of cells around p
+    void collectKNearest(const Point &p, unsigned int k, std::vector<std::pair<float, int>> &heap) const
+    {
+        heap.clear();
+        if (k == 0 || m_points.empty())
+            return;
+        int c[3], reach = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            c[axis] = cellCoordinate(p[axis], axis);
+            reach = std::max({reach, c[axis], m_dims[axis] - 1 - c[axis]});
+        }
+        auto visitRun = [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t j = begin; j < end; j++)
+            {
+                const std::pair<float, int> entry(squaredDistance(p, j), m_indices[j]);
+                if (heap.size() < k)
+                {
+                    heap.push_back(entry);
+                    std::push_heap(heap.begin(), heap.end());
+                }
+                else if (entry < heap.front())
+                {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = entry;
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+            return true;
+        };
+        double rowsVisited = 0;
+        for (int s = 0; s <= reach; s++)
+        {
+            rowsVisited += (2.0 * s + 1) * (2.0 * s + 1);
+            if (rowsVisited > (double)m_indices.size())
+            {
+                // the cells are too fine for this query, compare with every point instead
+                heap.clear();
+                visitRun(0, m_indices.size());
+                break;
+            }
+            const int x0 = std::max(0, c[0] - s), x1 = std::min(m_dims[0] - 1, c[0] + s);
+            for (int z = std::max(0, c[2] - s); z <= std::min(m_dims[2] - 1, c[2] + s); z++)
+            {
+                for (int y = std::max(0, c[1] - s); y <= std::min(m_dims[1] - 1, c[1] + s); y++)
+                {
+                    if (std::abs(z - c[2]) == s || std::abs(y - c[1]) == s)
+                    {
+                        visitRow(x0, x1, y, z, visitRun);
+                        continue;
+                    }
+                    // inside the cube only the cells at x = c -+ s belong to the shell
+                    if (c[0] - s >= 0)
+                        visitRow(c[0] - s, c[0] - s, y, z, visitRun);
+                    if (c[0] + s < m_dims[0])
+                        visitRow(c[0] + s, c[0] + s, y, z, visitRun);
+                }
+            }
+            if (heap.size() < k)
+                continue;
+            // distance from p to the nearest cell outside the searched cube
+            float bound = std::numeric_limits<float>::max();
+            for (int axis = 0; axis < 3; axis++)
+            {
+                if (c[axis] - s > 0)
+                    bound = std::min(bound, p[axis] - (m_origin[axis] + (c[axis] - s) * m_cellSize));
+                if (c[axis] + s < m_dims[axis] - 1)
+                    bound = std::min(bound, m_origin[axis] + (c[axis] + s + 1) * m_cellSize - p[axis]);
+            }
+            if (bound > 0 && heap.front().first < bound * bound)
+                break;
+        }
+        std::sort_heap(heap.begin(), heap.end());
+    }
+};
+
+/*
+ * Octree over the points: a cube is split into its eight octants until at most leafSize points are
+ * left, so dense regions get deep and sparse ones shallow subtrees. Every node keeps the tight
+ * bounding box and the range of its points, which are stored in node order. A radius query rejects
+ * a node whose box is out of reach with one test and takes a node whose box lies inside the ball as
+ * a whole range. Same interface as SpatialDataStructure, squared Euclidean distances only.
+ */
+class OctreeIndex
+{
+public:
+    OctreeIndex(PointList const &points, std::size_t leafSize = 64)
+        : m_points(points)
+    {
+        build(leafSize);
+    }
+
+    OctreeIndex(PointList &&points, std::size_t leafSize = 64)
+        : m_points(std::move(points))
+    {
+        build(leafSize);
+    }
+
+    PointList const &getPoints() const
+    {
+        return m_points;
+    }
+    Point const &point(std::size_t i) const
+    {
+        return m_points[i];
+    }
+    std::size_t nodeCount() const
+    {
+        return m_nodes.size();
+    }
+
+    // the indices of whole nodes inside the ball are copied without a distance test
+    std::vector<std::size_t> collectInRadius(const Point &p, float radius) const
+    {
+        std::vector<std::size_t> result;
+        collectInRadius(p, radius, result);
+        return result;
+    }
+
+    bool anyInRadius(const Point &p, float radius) const
+    {
+        auto stop = [](std::size_t, float)
+        { return false; };
+        auto stopRange = [](std::uint32_t, std::uint32_t)
+        { return false; };
+        return !m_nodes.empty() && !visitInRadius(p, radius * radius, 0, stopRange, stop);
+    }
+
+    std::size_t countInRadius(const Point &p, float radius) const
+    {
+        std::size_t count = 0;
+        auto countOne = [&](std::size_t, float)
+        {
+            count++;
+            return true;
+        };
+        auto countRange = [&](std::uint32_t begin, std::uint32_t end)
+        {
+            count += end - begin;
+            return true;
+        };
+        if (!m_nodes.empty())
+            visitInRadius(p, radius * radius, 0, countRange, countOne);
+        return count;
+    }
+
+    // the nearest point closer than radius, false if there is none
+    bool nearestWithin(const Point &p, float radius, std::size_t *index, float *distance = nullptr) const
+    {
+        std::vector<std::pair<float, int>> heap;
+        collectKNearest(p, 1, heap);
+        if (heap.empty() || !(heap[0].first < radius * radius))
+            return false;
+        *index = heap[0].second;
+        if (distance != nullptr)
+            *distance = std::sqrt(heap[0].first);
+        return true;
+    }
+
+    // visitor(index, point, squared distance) for every point closer than radius
+    template <typename Visitor>
+    void forEachInRadius(const Point &p, float radius, Visitor &&visitor) const
+    {
+        auto visitOne = [&](std::size_t j, float squaredDistance)
+        {
+            visitor((std::size_t)m_indices[j], m_points[m_indices[j]], squaredDistance);
+            return true;
+        };
+        // inside the ball the distances are only needed for the visitor
+        auto visitRange = [&](std::uint32_t begin, std::uint32_t end)
+        {
+            float measures[chunkSize];
+            for (std::uint32_t first = begin; first < end; first += chunkSize)
+            {
+                const std::size_t n = std::min<std::size_t>(chunkSize, end - first);
+                squaredDistances(&m_x[first], &m_y[first], &m_z[first], n, p, measures);
+                for (std::size_t i = 0; i < n; i++)
+                    visitor((std::size_t)m_indices[first + i], m_points[m_indices[first + i]], measures[i]);
+            }
+            return true;
+        };
+        if (!m_nodes.empty())
+            visitInRadius(p, radius * radius, 0, visitRange, visitOne);
+    }
+
+    // at most k indices sorted by distance, ties go to the smaller index
+    std::vector<std::size_t> collectKNearest(const Point &p, unsigned int k, std::vector<float> *distances = nullptr) const
+    {
+        std::vector<std::pair<float, int>> heap;
+        collectKNearest(p, k, heap);
+        std::vector<std::size_t> result(heap.size());
+        for (std::size_t i = 0; i < heap.size(); i++)
+            result[i] = heap[i].second;
+        if (distances != nullptr)
+        {
+            distances->resize(heap.size());
+            for (std::size_t i = 0; i < heap.size(); i++)
+                (*distances)[i] = std::sqrt(heap[i].first);
+        }
+        return result;
+    }
+
+    // collectInRadius for every query point, see runBatch
+    NeighborLists collectInRadiusBatch(ArrayView<Point> queries, float radius, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        return runBatch<char>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, char &)
+                              {
+            if (distances == nullptr)
+            {
+                collectInRadius(queries[q], radius, indices);
+                return;
+            }
+            forEachInRadius(queries[q], radius, [&](std::size_t idx, Point const &, float squaredDistance)
+                            {
+                indices.push_back(idx);
+                distances->push_back(std::sqrt(squaredDistance)); }); });
+    }
+
+    // collectKNearest for every query point, see runBatch
+    NeighborLists collectKNearestBatch(ArrayView<Point> queries, unsigned int k, bool withDistances = false, unsigned int numThreads = 0) const
+    {
+        return runBatch<std::vector<std::pair<float, int>>>(queries.size(), withDistances, numThreads, [&](std::size_t q, std::vector<std::size_t> &indices, std::vector<float> *distances, std::vector<std::pair<float, int>> &heap)
+                                                            {
+            collectKNearest(queries[q], k, heap);
+            for (auto const &entry : heap)
+            {
+                indices.push_back(entry.second);
+                if (distances != nullptr)
+                    distances->push_back(std::sqrt(entry.first));
+            } });
+    }
+
+private:
+    // octants of a cube this small are not split any further, which bounds the depth for duplicates
+    static constexpr int maxDepth = 21;
+    static constexpr std::size_t chunkSize = 64;
+
+    struct Node
+    {
+        float lo[3], hi[3];
+        // points m_indices[begin] ... m_indices[end - 1], children m_nodes[firstChild] ... + childCount - 1
+        std::uint32_t begin, end, firstChild;
+        std::uint8_t childCount;
+    };
+
+    PointList m_points;
+    std::size_t m_leafSize = 64;
+    std::vector<Node> m_nodes;
+    std::vector<float> m_x, m_y, m_z;
+    std::vector<int> m_indices;
+
+    void build(std::size_t leafSize)
+    {
+        m_leafSize = std::max<std::size_t>(leafSize, 1);
+        m_nodes.clear();
+        const std::size_t n = m_points.size();
+        if (n == 0)
+            return;
+        std::vector<int> indices(n), scratch(n);
+        std::iota(indices.begin(), indices.end(), 0);
+        Point lo = m_points[0], hi = m_points[0];
+        for (Point const &p : m_points)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                lo[axis] = std::min(lo[axis], p[axis]);
+                hi[axis] = std::max(hi[axis], p[axis]);
+            }
+        }
+        const float half = std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]}) / 2;
+        const Point center{(lo[0] + hi[0]) / 2, (lo[1] + hi[1]) / 2, (lo[2] + hi[2]) / 2};
+        m_nodes.push_back(Node{});
+        buildRecursive(0, indices, scratch, 0, (std::uint32_t)n, center, half, 0);
+
+        m_x.resize(n);
+        m_y.resize(n);
+        m_z.resize(n);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            m_x[i] = m_points[indices[i]][0];
+            m_y[i] = m_points[indices[i]][1];
+            m_z[i] = m_points[indices[i]][2];
+        }
+        m_indices = std::move(indices);
+    }
+
+    // points keep their relative order in every octant, so the leaves list them by index
+    void buildRecursive(std::uint32_t node, std::vector<int> &indices, std::vector<int> &scratch, std::uint32_t begin, std::uint32_t end,
+                        Point const &center, float half, int depth)
+    {
+        Node box{};
+        box.begin = begin;
+        box.end = end;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            box.lo[axis] = m_points[indices[begin]][axis];
+            box.hi[axis] = m_points[indices[begin]][axis];
+        }
+        for (std::uint32_t i = begin + 1; i < end; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                box.lo[axis] = std::min(box.lo[axis], m_points[indices[i]][axis]);
+                box.hi[axis] = std::max(box.hi[axis], m_points[indices[i]][axis]);
+            }
+        }
+        m_nodes[node] = box;
+        if (end - begin <= m_leafSize || depth == maxDepth)
+            return;
+
+        auto octant = [&](int idx)
+        {
+            Point const &p = m_points[idx];
+            return (p[0] >= center[0] ? 1 : 0) | (p[1] >= center[1] ? 2 : 0) | (p[2] >= center[2] ? 4 : 0);
+        };
+        std::uint32_t counts[8] = {}, starts[9] = {begin};
+        for (std::uint32_t i = begin; i < end; i++)
+            counts[octant(indices[i])]++;
+        for (int o = 0; o < 8; o++)
+            starts[o + 1] = starts[o] + counts[o];
+        std::uint32_t next[8];
+        std::copy(starts, starts + 8, next);
+        for (std::uint32_t i = begin; i < end; i++)
+            scratch[next[octant(indices[i])]++] = indices[i];
+        std::copy(scratch.begin() + begin, scratch.begin() + end, indices.begin() + begin);
+
+        const std::uint32_t firstChild = (std::uint32_t)m_nodes.size();
+        std::uint8_t childCount = 0;
+        for (int o = 0; o < 8; o++)
+            childCount += counts[o] > 0;
+        m_nodes[node].firstChild = firstChild;
+        m_nodes[node].childCount = childCount;
+        m_nodes.resize(m_nodes.size() + childCount);
+        std::uint32_t child = firstChild;
+        for (int o = 0; o < 8; o++)
+        {
+            if (counts[o] == 0)
+                continue;
+            const float quarter = half / 2;
+            const Point childCenter{center[0] + (o & 1 ? quarter : -quarter), center[1] + (o & 2 ? quarter : -quarter), center[2] + (o & 4 ? quarter : -quarter)};
+            buildRecursive(child++, indices, scratch, starts[o], starts[o + 1], childCenter, quarter, depth + 1);
+        }
+    }
+
+    static float boxDistance(Point const &p, Node const &node)
+    {
+        float d2 = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float d = std::max({node.lo[axis] - p[axis], 0.0f, p[axis] - node.hi[axis]});
+            d2 += d * d;
         }
-        return sumI;
+        return d2;
     }
-    static Point q_u(int m, int n, float u, float v, PointList WLS)
+    static float farthestCorner(Point const &p, Node const &node)
     {
-        int t = 0;
-        Point sumI{0.0, 0.0, 0.0};
-        for (int i = 0; i <= m; i++)
+        float d2 = 0;
+        for (int axis = 0; axis < 3; axis++)
         {
-            Point sumJ{0.0, 0.0, 0.0};
-            for (int j = 0; j <= n; j++)
-            {
-                Point sum1{Bezier::Bernstein(n, j, v) * WLS[t][0], Bezier::Bernstein(n, j, v) * WLS[t][1], Bezier::Bernstein(n, j, v) * WLS[t][2]};
-                sumJ[0] += sum1[0];
-                sumJ[1] += sum1[1];
-                sumJ[2] += sum1[2];
-                t += 1;
-            }
-            Point sum2{Bezier::Bderivative(m, i, u) * sumJ[0], Bezier::Bderivative(m, i, u) * sumJ[1], Bezier::Bderivative(m, i, u) * sumJ[2]};
-            sumI[0] += sum2[0];
-            sumI[1] += sum2[1];
-            sumI[2] += sum2[2];
+            const float d = std::max(p[axis] - node.lo[axis], node.hi[axis] - p[axis]);
+            d2 += d * d;
         }
-        return sumI;
+        return d2;
     }
-    static Point q_v(int m, int n, float u, float v, PointList WLS)
+
+    void collectInRadius(const Point &p, float radius, std::vector<std::size_t> &result) const
     {
+        auto collectOne = [&](std::size_t j, float)
+        {
+            result.push_back(m_indices[j]);
+            return true;
+        };
+        auto collectRange = [&](std::uint32_t begin, std::uint32_t end)
+        {
+            result.insert(result.end(), m_indices.begin() + begin, m_indices.begin() + end);
+            return true;
+        };
+        if (!m_nodes.empty())
+            visitInRadius(p, radius * radius, 0, collectRange, collectOne);
+    }
 
-        int t = 0;
-        Point sumI{0.0, 0.0, 0.0};
-        for (int i = 0; i <= m; i++)
+    /*
+     * rangeVisitor(begin, end) for nodes inside the ball, entryVisitor(j, squared distance) for the
+     * points closer than the limit in leaves that straddle it. Stops when a visitor returns false.
+     * A point lies no farther than the farthest corner of its box and no closer than the box, also
+     * in float arithmetic, so both tests agree with the per-point test.
+     */
+    template <typename RangeVisitor, typename EntryVisitor>
+    bool visitInRadius(const Point &p, float limit, std::uint32_t node, RangeVisitor &rangeVisitor, EntryVisitor &entryVisitor) const
+    {
+        Node const &n = m_nodes[node];
+        if (!(boxDistance(p, n) < limit))
+            return true;
+        if (farthestCorner(p, n) < limit)
+            return rangeVisitor(n.begin, n.end);
+        if (n.childCount == 0)
         {
-            Point sumJ{0.0, 0.0, 0.0};
-            for (int j = 0; j <= n; j++)
+            float measures[chunkSize];
+            for (std::uint32_t first = n.begin; first < n.end; first += chunkSize)
             {
-                Point sum1{Bezier::Bderivative(n, j, v) * WLS[t][0], Bezier::Bderivative(n, j, v) * WLS[t][1], Bezier::Bderivative(n, j, v) * WLS[t][2]};
-                sumJ[0] += sum1[0];
-                sumJ[1] += sum1[1];
-                sumJ[2] += sum1[2];
-                t += 1;
+                const std::size_t count = std::min<std::size_t>(chunkSize, n.end - first);
+                squaredDistances(&m_x[first], &m_y[first], &m_z[first], count, p, measures);
+                for (std::size_t i = 0; i < count; i++)
+                {
+                    if (measures[i] < limit && !entryVisitor(first + i, measures[i]))
+                        return false;
+                }
             }
-            Point sum2{Bezier::Bernstein(m, i, u) * sumJ[0], Bezier::Bernstein(m, i, u) * sumJ[1], Bezier::Bernstein(m, i, u) * sumJ[2]};
-            sumI[0] += sum2[0];
-            sumI[1] += sum2[1];
-            sumI[2] += sum2[2];
+            return true;
         }
-        return sumI;
+        for (std::uint32_t child = n.firstChild; child < n.firstChild + n.childCount; child++)
+        {
+            if (!visitInRadius(p, limit, child, rangeVisitor, entryVisitor))
+                return false;
+        }
+        return true;
     }
-    static std::array<float, 3> normal(int m, int n, float u, float v, PointList WLS)
+
+    // sorted (squared distance, index) pairs of the k nearest points
+    void collectKNearest(const Point &p, unsigned int k, std::vector<std::pair<float, int>> &heap) const
     {
-        Point q_u = Bezier::q_u(m, n, u, v, WLS);
-        Point q_v = Bezier::q_v(m, n, u, v, WLS);
-        float x = q_u[1] * q_v[2] - q_u[2] * q_v[1];
-        float y = q_u[2] * q_v[0] - q_u[0] * q_v[2];
-        float z = q_u[0] * q_v[1] - q_u[1] * q_v[0];
-        float leng = std::sqrt(x * x + y * y + z * z);
-        std::array<float, 3> normal = {x / leng * (float)0.05, y / leng * (float)0.05, z / leng * (float)0.05};
-        return normal;
+        heap.clear();
+        if (k > 0 && !m_nodes.empty())
+            collectKNearestRecursive(p, 0, heap, k);
+        std::sort_heap(heap.begin(), heap.end());
+    }
+    // nearer children first, a box as far as the current k-th point is still searched for smaller indices
+    void collectKNearestRecursive(const Point &p, std::uint32_t node, std::vector<std::pair<float, int>> &heap, unsigned int k) const
+    {
+        Node const &n = m_nodes[node];
+        if (n.childCount == 0)
+        {
+            float measures[chunkSize];
+            for (std::uint32_t first = n.begin; first < n.end; first += chunkSize)
+            {
+                const std::size_t count = std::min<std::size_t>(chunkSize, n.end - first);
+                squaredDistances(&m_x[first], &m_y[first], &m_z[first], count, p, measures);
+                for (std::size_t i = 0; i < count; i++)
+                {
+                    const std::pair<float, int> entry(measures[i], m_indices[first + i]);
+                    if (heap.size() < k)
+                    {
+                        heap.push_back(entry);
+                        std::push_heap(heap.begin(), heap.end());
+                    }
+                    else if (entry < heap.front())
+                    {
+                        std::pop_heap(heap.begin(), heap.end());
+                        heap.back() = entry;
+                        std::push_heap(heap.begin(), heap.end());
+                    }
+                }
+            }
+            return;
+        }
+        std::pair<float, std::uint32_t> children[8];
+        for (std::uint8_t c = 0; c < n.childCount; c++)
+            children[c] = std::make_pair(boxDistance(p, m_nodes[n.firstChild + c]), n.firstChild + c);
+        std::sort(children, children + n.childCount);
+        for (std::uint8_t c = 0; c < n.childCount; c++)
+        {
+            if (heap.size() == k && children[c].first > heap.front().first)
+                break;
+            collectKNearestRecursive(p, children[c].second, heap, k);
+        }
     }
 };
 
 /*
- * This is not yet a spatial data structure :)
+ * Streams an OFF file into a chunked index, holding at most one batch besides the chunks the
+ * index keeps in memory (all of them unless it spills them)
  */
-class SpatialDataStructure
+bool buildChunkedIndex(std::string const &filename, ChunkedSpatialIndex &index, std::size_t batchSize = std::size_t(1) << 18)
 {
-public:
-    SpatialDataStructure(PointList const &points)
-        : m_points(points), root(nullptr)
+    OffPointStream stream(filename);
+    if (!stream.isValid())
+        return false;
+    PointList batch;
+    while (stream.next(batch, nullptr, batchSize) > 0)
     {
-        build(points);
+        if (!index.addChunk(std::move(batch)))
+            return false;
     }
+    return stream.isValid() && stream.consumed() == stream.size();
+}
 
-    virtual ~SpatialDataStructure() = default;
+enum class CurveOrder
+{
+    None,
+    Morton,
+    Hilbert,
+};
 
-    PointList const &getPoints() const
-    {
-        return m_points;
-    }
+// spreads the low 10 bits of v so that two zero bits follow each of them
+inline std::uint32_t spreadBits(std::uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
 
-    void build(PointList const &points)
+// position along the curve of the cell (x, y, z) of a 1024^3 grid
+std::uint32_t curveKey(std::uint32_t x, std::uint32_t y, std::uint32_t z, CurveOrder order)
+{
+    if (order == CurveOrder::Hilbert)
     {
-        std::vector<int> indices(points.size());
-        std::iota(std::begin(indices), std::end(indices), 0);
-
-        root = buildRecursive(indices.data(), (int)points.size(), 0);
+        // Skilling's transform from axes to the transposed Hilbert index
+        std::uint32_t X[3] = {x, y, z};
+        for (std::uint32_t Q = 1u << 9; Q > 1; Q >>= 1)
+        {
+            const std::uint32_t P = Q - 1;
+            for (int i = 0; i < 3; i++)
+            {
+                if (X[i] & Q)
+                    X[0] ^= P;
+                else
+                {
+                    const std::uint32_t t = (X[0] ^ X[i]) & P;
+                    X[0] ^= t;
+                    X[i] ^= t;
+                }
+            }
+        }
+        X[1] ^= X[0];
+        X[2] ^= X[1];
+        std::uint32_t t = 0;
+        for (std::uint32_t Q = 1u << 9; Q > 1; Q >>= 1)
+        {
+            if (X[2] & Q)
+                t ^= Q - 1;
+        }
+        x = X[0] ^ t, y = X[1] ^ t, z = X[2] ^ t;
     }
+    return (spreadBits(x) << 2) | (spreadBits(y) << 1) | spreadBits(z);
+}
 
-    virtual std::vector<std::size_t> collectInRadius(const Point &p, float radius) const
-    {
-        std::vector<std::size_t> result;
-        collectInRadiusRecursive(p, this->root, result, radius);
-
-        return result;
-    }
+/*
+ * The order of points along a Morton or Hilbert curve through their bounding cube, as indices into
+ * points. Points in the same grid cell keep their relative order, so the result is deterministic.
+ */
+std::vector<std::size_t> curvePermutation(ArrayView<Point> points, CurveOrder order)
+{
+    std::vector<std::size_t> permutation(points.size());
+    std::iota(permutation.begin(), permutation.end(), std::size_t(0));
+    if (order == CurveOrder::None || points.size() < 2)
+        return permutation;
 
-    virtual std::vector<std::size_t> collectKNearest(const Point &p, unsigned int k) const
+    Point lo = points[0], hi = points[0];
+    for (Point const &p : points)
     {
-        std::vector<std::size_t> result;
-        std::vector<std::pair<float, int>> queue;
-        collectKNearestRecursive(p, root, queue, k);
-        for (unsigned int i = 0; i < k; i++)
+        for (int axis = 0; axis < 3; axis++)
         {
-            int idx = queue[i].second;
-            result.push_back(idx);
+            lo[axis] = std::min(lo[axis], p[axis]);
+            hi[axis] = std::max(hi[axis], p[axis]);
         }
-
-        return result;
     }
-
-private:
-    PointList m_points;
-    struct Node
+    const float extent = std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+    const float scale = extent > 0 ? 1023.0f / extent : 0.0f;
+    std::vector<std::pair<std::uint32_t, std::size_t>> keys(points.size());
+    for (std::size_t i = 0; i < points.size(); i++)
     {
-        int idx;
-        Node *next[2];
-        int axis;
-        Node() : idx(-1), axis(-1) { next[0] = next[1] = nullptr; }
-    };
-    Node *root;
+        std::uint32_t cell[3];
+        for (int axis = 0; axis < 3; axis++)
+            cell[axis] = (std::uint32_t)std::min(1023.0f, std::max(0.0f, (points[i][axis] - lo[axis]) * scale));
+        keys[i] = std::make_pair(curveKey(cell[0], cell[1], cell[2], order), i);
+    }
+    std::sort(keys.begin(), keys.end());
+    for (std::size_t i = 0; i < keys.size(); i++)
+        permutation[i] = keys[i].second;
+    return permutation;
+}
 
-    Node *buildRecursive(int *indices, int npoints, int depth)
+/*
+ * Sorts points along the curve and moves normals and face indices with them. Normals are only
+ * permuted if there is one per point.
+ */
+void reorderAlongCurve(CurveOrder order, PointList *points, std::vector<Normal> *normals = nullptr, std::vector<std::array<int, 3>> *faces = nullptr)
+{
+    if (order == CurveOrder::None || points->size() < 2)
+        return;
+    const std::vector<std::size_t> permutation = curvePermutation(*points, order);
+    const std::size_t n = points->size();
+    PointList sorted(n);
+    for (std::size_t i = 0; i < n; i++)
+        sorted[i] = (*points)[permutation[i]];
+    *points = std::move(sorted);
+    if (normals != nullptr && normals->size() == n)
     {
-        if (npoints <= 0)
-            return nullptr;
-
-        const int axis = depth % 3;
-        const int mid = (npoints - 1) / 2;
-        std::nth_element(indices, indices + mid, indices + npoints, [&](int lhs, int rhs)
-                         { return m_points[lhs][axis] < m_points[rhs][axis]; });
-
-        Node *node = new Node();
-        node->idx = indices[mid];
-        node->axis = axis;
-
-        node->next[0] = buildRecursive(indices, mid, depth + 1);
-        node->next[1] = buildRecursive(indices + mid + 1, npoints - mid - 1, depth + 1);
-        return node;
+        std::vector<Normal> sortedNormals(n);
+        for (std::size_t i = 0; i < n; i++)
+            sortedNormals[i] = (*normals)[permutation[i]];
+        *normals = std::move(sortedNormals);
     }
-    void collectInRadiusRecursive(Point q, Node *node, std::vector<size_t> &result, float radius) const
+    if (faces != nullptr && !faces->empty())
     {
-        if (node == nullptr)
-            return;
-
-        const Point &temp = m_points[node->idx];
-
-        const float dist = EuclideanDistance::measure(q, temp);
-        if (dist < radius)
-            result.push_back(node->idx);
-
-        const int axis = node->axis;
-        const int dir = q[axis] < temp[axis] ? 0 : 1;
-        collectInRadiusRecursive(q, node->next[dir], result, radius);
-
-        const float diff = fabs(q[axis] - temp[axis]);
-        if (diff < radius)
+        std::vector<int> newIndex(n);
+        for (std::size_t i = 0; i < n; i++)
+            newIndex[permutation[i]] = (int)i;
+        for (std::array<int, 3> &face : *faces)
         {
-            collectInRadiusRecursive(q, node->next[!dir], result, radius);
+            for (int &v : face)
+                v = newIndex[v];
         }
     }
-    void collectKNearestRecursive(Point q, Node *node, std::vector<std::pair<float, int>> &queue, std::size_t k) const
-    {
-        if (node == nullptr)
-            return;
-
-        const Point temp = m_points[node->idx];
-
-        const float dist = EuclideanDistance::measure(q, temp);
-        queue.push_back(std::make_pair(dist, node->idx));
-        std::sort(queue.begin(), queue.end());
-        if (queue.size() > k)
-            queue.resize(k);
-        const int axis = node->axis;
-        const int dir = q[axis] < temp[axis] ? 0 : 1;
-        collectKNearestRecursive(q, node->next[dir], queue, k);
-        const float diff = fabs(q[axis] - temp[axis]);
-        if (queue.size() < k || diff < queue.back().first)
-            collectKNearestRecursive(q, node->next[!dir], queue, k);
-    }
-};
+}
 
+// Wendland weight of a point at distance d
+inline float weightAtDistance(float d, float h)
+{
+    const float t = 1 - d / h, t2 = t * t;
+    return t2 * t2 * (4 * d / h + 1);
+}
 float weight(Point fixedPoint, Point X, float h)
 {
-    float d = EuclideanDistance::measure(fixedPoint, X);
-    return std::pow(1 - d / h, 4) * (4 * d / h + 1);
+    return weightAtDistance(EuclideanDistance::measure(fixedPoint, X), h);
 }
 
 // Application variables
 polyscope::PointCloud *pc = nullptr;
 std::unique_ptr<SpatialDataStructure> sds;
-std::vector<Normal> normals;
+MappedArray<Normal> normals;
 std::unique_ptr<SpatialDataStructure> sds2;
+// used instead of sds2 when n3 runs with useQuantizedStore (--quantized or the viewer's checkbox)
+std::unique_ptr<QuantizedSpatialIndex> sds2q;
+bool useQuantizedStore = false;
+enum class IndexBackend
+{
+    KdTree,
+    Grid,
+    Octree,
+    Dynamic,
+    Chunked,
+};
+// set with --index or in the viewer, the structure n3 builds over the constraint points unless --quantized is given
+IndexBackend constraintBackend = IndexBackend::KdTree;
+// used instead of sds2 with IndexBackend::Grid, rebuilt whenever the query radius changes
+std::unique_ptr<UniformGridIndex> sds2g;
+// used instead of sds2 with IndexBackend::Octree
+std::unique_ptr<OctreeIndex> sds2o;
+// used instead of sds2 with IndexBackend::Dynamic
+std::unique_ptr<DynamicSpatialIndex> sds2d;
+// used instead of sds2 with IndexBackend::Chunked, its chunk trees spilled to a temporary file
+std::unique_ptr<ChunkedSpatialIndex> sds2c;
+// constraint points per chunk of sds2c
+constexpr std::size_t constraintChunkSize = std::size_t(1) << 16;
+// set with --reorder: loaded points and query batches are sorted along this curve
+CurveOrder pointOrder = CurveOrder::None;
+// set with --approx-nn: outside the radius the kd-tree finds a (1 + epsilon)-approximate nearest point
+float nearestEpsilon = 0.0f;
+// approximate nearest-point lookups since ImplicitValue started and the largest error they guarantee,
+// updated from the threads of functionValues and shown below the reconstruction controls
+std::atomic<std::size_t> approxNearestLookups{0};
+std::atomic<float> approxNearestError{0.0f};
 std::unique_ptr<SpatialDataStructure> sds3;
 float minX, minY, minZ, maxX, maxY, maxZ;
 
@@ -717,6 +5638,11 @@ polyscope::PointCloud *rayIntersect = nullptr;
 std::vector<float> depth;
 std::vector<float> depth_Z;
 std::vector<bool> contact;
+PointList surfacePoints;
+std::vector<Normal> surfaceNormals;
+std::vector<std::array<size_t, 3>> surfaceFaces;
+// while set, extractSurface streams every extracted surface into this file
+std::string surfaceStreamPath;
 /*PointList grid;
 PointList WLS;
 polyscope::PointCloud *wlsp = nullptr;
@@ -768,6 +5694,25 @@ float gridGernate(int Nx, int Ny, int Nz)
     return diagonal;
 }
 
+/*
+ * The largest alpha / 2^m for which no point lies closer than that to p + alpha * n, what halving
+ * alpha until the ball around the first offset point is empty gives. The nearest point within alpha
+ * bounds every halving step at once, anyInRadius confirms the last one.
+ */
+float safeOffset(SpatialDataStructure const &index, Point const &p, Normal const &n, float alpha)
+{
+    const Point center = Point{p[0] + alpha * n[0], p[1] + alpha * n[1], p[2] + alpha * n[2]};
+    std::size_t nearest;
+    float distance;
+    if (!index.nearestWithin(center, alpha, &nearest, &distance))
+        return alpha;
+    while (alpha > distance)
+        alpha = alpha / 2.0;
+    while (index.anyInRadius(center, alpha))
+        alpha = alpha / 2.0;
+    return alpha;
+}
+
 void n3(float diagonal)
 {
     PointList posN, negN;
@@ -779,72 +5724,195 @@ void n3(float diagonal)
         functionVal.push_back(Implicit{temp[0], temp[1], temp[2], 0.0});
         n_3.push_back(temp);
         Normal tempN = normals[i];
+        alpha = safeOffset(*sds, temp, tempN, alpha);
         Point pos = Point{temp[0] + alpha * tempN[0], temp[1] + alpha * tempN[1], temp[2] + alpha * tempN[2]};
-        Point neg = Point{temp[0] - alpha * tempN[0], temp[1] - alpha * tempN[1], temp[2] - alpha * tempN[2]};
-        while (!sds->collectInRadius(pos, alpha).empty())
-        {
-            alpha = alpha / 2.0;
-        }
-        pos = Point{temp[0] + alpha * tempN[0], temp[1] + alpha * tempN[1], temp[2] + alpha * tempN[2]};
         posN.push_back(pos);
         n_3.push_back(pos);
         functionVal.push_back(Implicit{pos[0], pos[1], pos[2], alpha});
         alp.push_back(alpha);
-        alpha = 0.01 * diagonal;
-        while (!sds->collectInRadius(neg, alpha).empty())
-        {
-            alpha = alpha / 2.0;
-        }
-        neg = Point{temp[0] - alpha * tempN[0], temp[1] - alpha * tempN[1], temp[2] - alpha * tempN[2]};
+        alpha = safeOffset(*sds, temp, Normal{-tempN[0], -tempN[1], -tempN[2]}, 0.01 * diagonal);
+        Point neg = Point{temp[0] - alpha * tempN[0], temp[1] - alpha * tempN[1], temp[2] - alpha * tempN[2]};
         negN.push_back(neg);
         n_3.push_back(neg);
         functionVal.push_back(Implicit{neg[0], neg[1], neg[2], -alpha});
         alp2.push_back(-alpha);
     }
 
-    sds2 = std::make_unique<SpatialDataStructure>(n_3);
+    if (useQuantizedStore)
+    {
+        sds2.reset();
+        sds2g.reset();
+        sds2o.reset();
+        sds2d.reset();
+        sds2c.reset();
+        sds2q = std::make_unique<QuantizedSpatialIndex>(n_3);
+    }
+    else if (constraintBackend == IndexBackend::Grid)
+    {
+        sds2.reset();
+        sds2q.reset();
+        sds2o.reset();
+        sds2d.reset();
+        sds2c.reset();
+        sds2g = std::make_unique<UniformGridIndex>(n_3, 0.01f * diagonal);
+    }
+    else if (constraintBackend == IndexBackend::Octree)
+    {
+        sds2.reset();
+        sds2q.reset();
+        sds2g.reset();
+        sds2d.reset();
+        sds2c.reset();
+        sds2o = std::make_unique<OctreeIndex>(n_3);
+    }
+    else if (constraintBackend == IndexBackend::Dynamic)
+    {
+        sds2.reset();
+        sds2q.reset();
+        sds2g.reset();
+        sds2o.reset();
+        sds2c.reset();
+        sds2d = std::make_unique<DynamicSpatialIndex>(n_3);
+    }
+    else if (constraintBackend == IndexBackend::Chunked)
+    {
+        sds2.reset();
+        sds2q.reset();
+        sds2g.reset();
+        sds2o.reset();
+        sds2d.reset();
+        sds2c = std::make_unique<ChunkedSpatialIndex>(ChunkedSpatialIndex::spillPathFor("cg2-constraints"));
+        for (std::size_t first = 0; first < n_3.size(); first += constraintChunkSize)
+        {
+            if (!sds2c->addChunk(PointList(n_3.begin() + first, n_3.begin() + std::min(n_3.size(), first + constraintChunkSize))))
+            {
+                polyscope::warning("could not spill the constraint points, using the kd-tree instead");
+                sds2c.reset();
+                sds2 = std::make_unique<SpatialDataStructure>(n_3);
+                break;
+            }
+        }
+    }
+    else
+    {
+        sds2q.reset();
+        sds2g.reset();
+        sds2o.reset();
+        sds2d.reset();
+        sds2c.reset();
+        sds2 = std::make_unique<SpatialDataStructure>(n_3);
+    }
     pN = polyscope::registerPointCloud("PN", posN);
     pN->addScalarQuantity("fx", alp);
     nN = polyscope::registerPointCloud("nN", negN);
     nN->addScalarQuantity("fx", alp2);
 }
-float functionValue(Point fixed, float radius, float h)
+// drops the constraint points of the previous cloud, the next reconstruction runs n3 again
+void clearConstraints()
+{
+    functionVal.clear();
+    n_3.clear();
+    sds2.reset();
+    sds2q.reset();
+    sds2g.reset();
+    sds2o.reset();
+    sds2d.reset();
+    sds2c.reset();
+}
+float outsideSign(std::size_t idx)
+{
+    if (functionVal[idx][3] < 0)
+        return -10000.0;
+    else if (functionVal[idx][3] == 0)
+        return 0.0;
+    else
+        return 10000.0;
+}
+// value far from every constraint point: the sign of the nearest one
+template <typename Index>
+float outsideValue(Index const &index, Point fixed)
+{
+    return outsideSign(index.collectKNearest(fixed, 1)[0]);
+}
+// only the sign is used, so with --approx-nn any point not much farther than the nearest will do
+float outsideValue(SpatialDataStructure const &index, Point fixed)
+{
+    if (nearestEpsilon <= 0)
+        return outsideSign(index.collectKNearest(fixed, 1)[0]);
+    float error = 0;
+    const std::size_t idx = index.collectKNearestApprox(fixed, 1, nearestEpsilon, nullptr, &error)[0];
+    approxNearestLookups++;
+    float largest = approxNearestError.load(std::memory_order_relaxed);
+    while (error > largest && !approxNearestError.compare_exchange_weak(largest, error, std::memory_order_relaxed))
+        ;
+    return outsideSign(idx);
+}
+// MLS value at fixed, summed in one pass over the constraint points within the radius as the index finds them
+template <typename Index>
+float functionValue(Index const &index, Point fixed, float radius, float h)
 {
     float ft = 0.0;
     float st = 0.0;
-    //Eigen::Matrix<float, 4, 4> ft; ft.setZero();
-    //Eigen::Matrix<float, 4, 1> st; st.setZero();
-    float x = fixed[0], y = fixed[1], z = fixed[2];
-    float w;
-    std::vector<std::size_t> InRad = sds2->collectInRadius(fixed, radius);
-    if (InRad.empty())
-    {
-        int idx = sds2->collectKNearest(fixed, 1)[0];
-        if (functionVal[idx][3] < 0)
-            w = -10000.0;
-        else if(functionVal[idx][3] == 0)
-            w = 0.0;
-        else
-            w = 10000.0;
+    bool found = false;
+    index.forEachInRadius(fixed, radius, [&](std::size_t idx, Point const &, float squaredDistance)
+                          {
+        const float W = weightAtDistance(std::sqrt(squaredDistance), h);
+        ft += W, st += W * functionVal[idx][3];
+        found = true; });
+    if (!found)
+        return outsideValue(index, fixed);
+    return 1 / ft * st;
+}
+// functionValue for many points on all cores, no neighbour lists are gathered
+template <typename Index>
+std::vector<float> functionValues(Index const &index, ArrayView<Point> fixed, float radius, float h)
+{
+    std::vector<float> values(fixed.size());
+    if (pointOrder == CurveOrder::None)
+    {
+        parallelFor(fixed.size(), 0, [&](std::size_t i)
+                    { values[i] = functionValue(index, fixed[i], radius, h); });
+        return values;
     }
-    else
+    // consecutive queries along the curve share most of their tree nodes and neighbours
+    const std::vector<std::size_t> permutation = curvePermutation(fixed, pointOrder);
+    parallelFor(fixed.size(), 0, [&](std::size_t i)
+                { values[permutation[i]] = functionValue(index, fixed[permutation[i]], radius, h); });
+    return values;
+}
+std::vector<float> functionValues(ArrayView<Point> fixed, float radius, float h)
+{
+    if (sds2q)
+        return functionValues(*sds2q, fixed, radius, h);
+    if (sds2g)
     {
-        for (size_t j = 0; j < InRad.size(); j++)
-        {
-            Point train = sds2->getPoints()[InRad[j]];
-            float W = weight(fixed, train, h);
-            //Eigen::Matrix<float, 4, 1> bx {1, train[0] , train[1], train[2]};
-            ft += W, st += W * functionVal[InRad[j]][3];
-            //ft += W * bx * bx.transpose(), st += W * bx * functionVal[InRad[j]][3];
-        }
-
-        float c = 1 / ft * st;
-        w = c;
-        //Eigen::Matrix<float,4,1> c = ft.inverse()*st;
-        //Eigen::Matrix<float,1,4> Basis {1,x,y,z};
-        //w = Basis * c;
+        sds2g->setRadius(radius);
+        return functionValues(*sds2g, fixed, radius, h);
+    }
+    if (sds2o)
+        return functionValues(*sds2o, fixed, radius, h);
+    if (sds2d)
+        return functionValues(*sds2d, fixed, radius, h);
+    if (sds2c)
+        return functionValues(*sds2c, fixed, radius, h);
+    return functionValues(*sds2, fixed, radius, h);
+}
+float functionValue(Point fixed, float radius, float h)
+{
+    if (sds2q)
+        return functionValue(*sds2q, fixed, radius, h);
+    if (sds2g)
+    {
+        sds2g->setRadius(radius);
+        return functionValue(*sds2g, fixed, radius, h);
     }
-    return w;
+    if (sds2o)
+        return functionValue(*sds2o, fixed, radius, h);
+    if (sds2d)
+        return functionValue(*sds2d, fixed, radius, h);
+    if (sds2c)
+        return functionValue(*sds2c, fixed, radius, h);
+    return functionValue(*sds2, fixed, radius, h);
 }
 std::array<float,3> finiteDifference(Point point, float radius, float h){
     float epsilon = (maxX-minX)/5000;
@@ -854,11 +5922,17 @@ std::array<float,3> finiteDifference(Point point, float radius, float h){
     float length = sqrt(x*x+y*y+z*z);
     return std::array<float,3> {x/length,y/length,z/length};
 }
-void ImplicitValue(float radius, float h)
+// false, leaving gridVal empty, if the constraint index lost points while it was queried
+bool ImplicitValue(float radius, float h)
 {
     gridVal.clear();
     std::vector<float> fx;
     std::vector<std::array<float, 3>> Color;
+    approxNearestLookups = 0;
+    approxNearestError = 0.0f;
+    std::vector<float> values = functionValues(sds3->getPoints(), radius, h);
+    if (sds2c && sds2c->failed())
+        return false;
     for (size_t i = 0; i < sds3->getPoints().size(); i++)
     {
         //float ft = 0.0;
@@ -867,7 +5941,7 @@ void ImplicitValue(float radius, float h)
         // Eigen::Matrix<float, 4, 1> st; st.setZero();
         Point fixed = sds3->getPoints()[i];
         float x = fixed[0], y = fixed[1], z = fixed[2];
-        float w = functionValue(fixed, radius, h);
+        float w = values[i];
         /*std::vector<std::size_t> InRad = sds2->collectInRadius(fixed, radius);
         if (InRad.empty())
         {
@@ -913,6 +5987,7 @@ void ImplicitValue(float radius, float h)
     }
     box->addScalarQuantity("fx", fx);
     box->addColorQuantity("Color", Color);
+    return true;
 }
 Point VertexInterp(float isolevel, Point v1, Point v2, float w1, float w2)
 {
@@ -933,7 +6008,8 @@ Point VertexInterp(float isolevel, Point v1, Point v2, float w1, float w2)
     //return v2;
 }
 
-void marchingCubes(int Nx, int Ny, int Nz, float radius, float h)
+// with a writer the triangles are also streamed to its file while the surface is extracted
+void marchingCubes(int Nx, int Ny, int Nz, float radius, float h, MeshWriter *writer = nullptr)
 {
     PointList triangles;
     std::vector<std::array<float,3>> normal;
@@ -1018,16 +6094,22 @@ void marchingCubes(int Nx, int Ny, int Nz, float radius, float h)
             normal.push_back(finiteDifference(vertlist[triTable[cubeIdx][i+1]],radius,h));
             normal.push_back(finiteDifference(vertlist[triTable[cubeIdx][i+2]],radius,h));
             ntriang += 1;
+            if (writer != nullptr)
+                writer->addTriangle(triangles[triangles.size() - 3], triangles[triangles.size() - 2], triangles.back(), &normal[normal.size() - 3]);
         }
     }
 
     std::vector<std::array<size_t, 3>> triangleEdges;
-    for (size_t i = 0; i < triangles.size() - 2; i += 3)
+    for (size_t i = 0; i + 2 < triangles.size(); i += 3)
     {
         triangleEdges.push_back(std::array<size_t, 3>{i, i + 1, i + 2});
     }
     polygon = polyscope::registerSurfaceMesh("polygon", triangles, triangleEdges);
     polygon->addVertexVectorQuantity("normals",normal);
+    // keep the extracted surface for writePly
+    surfacePoints = std::move(triangles);
+    surfaceNormals = std::move(normal);
+    surfaceFaces = std::move(triangleEdges);
     // polygonP = polyscope::registerPointCloud("test2",triangles);
 }
 Eigen::MatrixXf PseudoInverse(Eigen::MatrixXf matrix) {
@@ -1037,7 +6119,7 @@ Eigen::MatrixXf PseudoInverse(Eigen::MatrixXf matrix) {
          * (svd.singularValues().array().abs() > tolerance).select(svd.singularValues().array().inverse(), 0).matrix().asDiagonal()
          * svd.matrixU().adjoint();
 }
-void EmarchingCubes(int Nx, int Ny, int Nz, float radius, float h)
+void EmarchingCubes(int Nx, int Ny, int Nz, float radius, float h, MeshWriter *writer = nullptr)
 {
     PointList triangles;
     std::vector<std::array<float,3>> normal;
@@ -1045,6 +6127,7 @@ void EmarchingCubes(int Nx, int Ny, int Nz, float radius, float h)
     for (size_t i = 0; i < sds3->getPoints().size(); i++)
     {
         int ntriang = 0;
+        const size_t firstCorner = triangles.size();
         std::array<Point, 12> vertlist;
         if ((int)i % (Nz + 1) == Nz || (int)i % ((Ny + 1) * (Nz + 1)) >= (Nz + 1) * Ny || (int)i % ((Nx + 1) * (Ny + 1) * (Nz + 1)) >= (Nz + 1) * (Ny + 1) * Nx)
             continue;
@@ -1200,19 +6283,42 @@ void EmarchingCubes(int Nx, int Ny, int Nz, float radius, float h)
             }    
 
         }
-        
+        if (writer != nullptr)
+        {
+            for (size_t k = firstCorner; k + 2 < triangles.size(); k += 3)
+                writer->addTriangle(triangles[k], triangles[k + 1], triangles[k + 2], &normal[k]);
+        }
     }
 
     std::vector<std::array<size_t, 3>> triangleEdges;
-    for (size_t i = 0; i < triangles.size() - 2; i += 3)
+    for (size_t i = 0; i + 2 < triangles.size(); i += 3)
     {
         triangleEdges.push_back(std::array<size_t, 3>{i, i + 1, i + 2});
     }
     polygon = polyscope::registerSurfaceMesh("polygon", triangles, triangleEdges);
     polygon->addVertexVectorQuantity("normals",normal);
+    // keep the extracted surface for writePly
+    surfacePoints = std::move(triangles);
+    surfaceNormals = std::move(normal);
+    surfaceFaces = std::move(triangleEdges);
     //polygonP = polyscope::registerPointCloud("test2",triangles);
 }
 
+// runs (extended) marching cubes, writing the triangles to surfaceStreamPath as they are produced
+void extractSurface(int Nx, int Ny, int Nz, float radius, float h, bool extended = false)
+{
+    MeshWriter writer;
+    if (!surfaceStreamPath.empty() && !writer.open(surfaceStreamPath, true))
+        polyscope::warning("could not write " + surfaceStreamPath);
+    MeshWriter *out = writer.isOpen() ? &writer : nullptr;
+    if (extended)
+        EmarchingCubes(Nx, Ny, Nz, radius, h, out);
+    else
+        marchingCubes(Nx, Ny, Nz, radius, h, out);
+    if (out != nullptr && !writer.close())
+        polyscope::warning("could not write " + surfaceStreamPath);
+}
+
 void rayTracing(int px, int py, float radius, float h){
     PointList intersect;
     depth.clear();
@@ -1368,7 +6474,7 @@ float cotAlpha(Point p0, Point p1, Point alpha){
 
     return S;
 }*/
-PointList LaplacianSmoothing(std::vector<Point> points, std::vector<std::array<int,3>> edges, int iteration, float h){
+PointList LaplacianSmoothing(ArrayView<Point> points, ArrayView<std::array<int,3>> edges, int iteration, float h){
     Eigen::MatrixXf P(points.size(),3);
     Eigen::MatrixXf M(points.size(), points.size());
     Eigen::MatrixXf L(points.size(), points.size());
@@ -1464,7 +6570,7 @@ PointList LaplacianSmoothing(std::vector<Point> points, std::vector<std::array<i
 
 
 }*/
-PointList cotLaplacianSmoothing(std::vector<Point> points, std::vector<std::array<int,3>> edges, int iteration, float h, bool EorI){
+PointList cotLaplacianSmoothing(ArrayView<Point> points, ArrayView<std::array<int,3>> edges, int iteration, float h, bool EorI){
     Eigen::MatrixXf P(points.size(), 3);
     for(int i = 0 ; i < (int) points.size(); i++){
         P(i,0) = points[i][0];
@@ -1586,9 +6692,203 @@ PointList cotLaplacianSmoothing(std::vector<Point> points, std::vector<std::arra
     return S;
 
 
-}
-std::vector<Point> points;
-std::vector<std::array<int,3>> edges;
+}
+/*
+ * Metadata section (CacheSection::KdTree) of a stored kd-tree. A "<source>.cg2tree" snapshot is
+ * only restored for the same source contents, point order and bucket size. The tree stored in a
+ * ".cg2cache" is always over the cached positions in file order and has no checksum, the cache
+ * being tied to the size and mtime of the source already.
+ */
+struct TreeSnapshotInfo
+{
+    std::uint64_t sourceChecksum;
+    std::uint64_t pointCount;
+    std::uint32_t bucketSize;
+    std::uint32_t pointOrder;
+};
+
+// writes tree, built over the points read from source, as the snapshot of source
+bool saveTreeSnapshot(std::string const &source, SpatialDataStructure const &tree)
+{
+    TreeSnapshotInfo info{0, tree.getPoints().size(), (std::uint32_t)tree.bucketSize(), (std::uint32_t)pointOrder};
+    if (!fileChecksum(source, &info.sourceChecksum))
+        return false;
+    std::vector<MeshCache::Blob> blobs = tree.snapshotSections();
+    blobs.push_back(MeshCache::blob(CacheSection::KdTree, ArrayView<TreeSnapshotInfo>(&info, 1)));
+    return MeshCache::write(source, blobs, ".cg2tree");
+}
+
+// the tree over points read from source from its snapshot, null if there is no valid one
+std::unique_ptr<SpatialDataStructure> loadTreeSnapshot(std::string const &source, PointList const &points)
+{
+    auto snapshot = std::make_shared<MeshCache>();
+    if (!snapshot->open(source, ".cg2tree"))
+        return nullptr;
+    ArrayView<TreeSnapshotInfo> info = snapshot->section<TreeSnapshotInfo>(CacheSection::KdTree);
+    std::uint64_t checksum;
+    if (info.size() != 1 || info[0].pointCount != points.size() || info[0].pointOrder != (std::uint32_t)pointOrder ||
+        !fileChecksum(source, &checksum) || checksum != info[0].sourceChecksum)
+        return nullptr;
+    auto tree = std::make_unique<SpatialDataStructure>();
+    if (!tree->restore(snapshot, MappedArray<Point>(points), info[0].bucketSize))
+        return nullptr;
+    return tree;
+}
+
+// writes source's ".cg2cache" with the mesh and tree, which has to be built over the points in file order
+bool saveCachedMesh(std::string const &source, SpatialDataStructure const &tree, ArrayView<Normal> normals, ArrayView<std::array<int, 3>> faces,
+                    std::size_t droppedFaces)
+{
+    TreeSnapshotInfo info{0, tree.getPoints().size(), (std::uint32_t)tree.bucketSize(), (std::uint32_t)CurveOrder::None};
+    std::vector<MeshCache::Blob> blobs = tree.snapshotSections();
+    blobs.push_back(MeshCache::blob(CacheSection::KdTree, ArrayView<TreeSnapshotInfo>(&info, 1)));
+    blobs.push_back(MeshCache::blob(CacheSection::Positions, tree.getPoints()));
+    blobs.push_back(MeshCache::blob(CacheSection::Faces, faces));
+    if (!normals.empty())
+        blobs.push_back(MeshCache::blob(CacheSection::Normals, normals));
+    return MeshCache::write(source, blobs, ".cg2cache", droppedFaces);
+}
+
+// the tree stored in a mapped ".cg2cache", viewing the mapping for its arrays and points, null without one
+std::unique_ptr<SpatialDataStructure> loadCachedTree(MappedMesh const &mesh)
+{
+    ArrayView<TreeSnapshotInfo> info = mesh.cache()->section<TreeSnapshotInfo>(CacheSection::KdTree);
+    if (info.size() != 1 || info[0].pointCount != mesh.points().size() || info[0].pointOrder != (std::uint32_t)CurveOrder::None)
+        return nullptr;
+    auto tree = std::make_unique<SpatialDataStructure>();
+    if (!tree->restore(mesh.cache(), MappedArray<Point>(mesh.points(), mesh.cache()), info[0].bucketSize))
+        return nullptr;
+    return tree;
+}
+
+/*
+ * Geometry loaded from a file together with its spatial data structure
+ */
+struct LoadedAsset
+{
+    std::string path;
+    // viewed in the cache mapping together with the tree when the file's cache holds one
+    MappedArray<Point> points;
+    MappedArray<Normal> normals;
+    MappedArray<std::array<int, 3>> faces;
+    std::unique_ptr<SpatialDataStructure> sds;
+    // faces the reader left out because of out-of-range vertex indices
+    std::size_t droppedFaces = 0;
+};
+
+/*
+ * Loads OFF/OBJ/PLY files and builds their SpatialDataStructure on a worker thread. Unless
+ * --no-cache is given, a file whose ".cg2cache" already holds the tree is used straight from the
+ * mapping without parsing, building or copying, and after a build the tree is stored in the
+ * ".cg2cache", or in a ".cg2tree" snapshot when the points were reordered (--reorder).
+ * The UI polls ready() every frame and registers the result on the main thread.
+ */
+class AssetLoader
+{
+public:
+    ~AssetLoader()
+    {
+        cancel();
+        if (m_result.valid())
+            m_result.wait();
+    }
+
+    void start(std::string const &path)
+    {
+        m_progress = std::make_shared<LoadProgress>();
+        std::shared_ptr<LoadProgress> progress = m_progress;
+        m_result = std::async(std::launch::async, [path, progress]
+                              { return load(path, *progress); });
+    }
+
+    bool busy() const
+    {
+        return m_result.valid();
+    }
+    bool ready() const
+    {
+        return m_result.valid() && m_result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+    // the loaded asset, without sds if the load failed and with an empty path if it was cancelled
+    LoadedAsset take()
+    {
+        LoadedAsset asset = m_result.get();
+        if (m_progress->cancelled())
+            return LoadedAsset{};
+        return asset;
+    }
+    void cancel()
+    {
+        if (m_progress)
+            m_progress->cancel = true;
+    }
+    LoadProgress const &progress() const
+    {
+        return *m_progress;
+    }
+
+private:
+    std::future<LoadedAsset> m_result;
+    std::shared_ptr<LoadProgress> m_progress;
+
+    static LoadedAsset load(std::string const &path, LoadProgress &progress)
+    {
+        LoadedAsset asset;
+        asset.path = path;
+        if (meshCacheEnabled && pointOrder == CurveOrder::None)
+        {
+            MappedMesh cached;
+            if (cached.open(path) && (asset.sds = loadCachedTree(cached)) != nullptr)
+            {
+                progress.total = progress.done = cached.size();
+                asset.points = MappedArray<Point>(cached.points(), cached.cache());
+                asset.normals = MappedArray<Normal>(cached.normals(), cached.cache());
+                asset.faces = MappedArray<std::array<int, 3>>(cached.faces(), cached.cache());
+                asset.droppedFaces = cached.droppedFaces();
+                return asset;
+            }
+        }
+
+        PointList points;
+        std::vector<Normal> normals;
+        std::vector<std::array<int, 3>> faces;
+        std::string extension = std::filesystem::path(path).extension().string();
+        if (extension == ".obj")
+            readOffobj(path, &points, &faces, 0, &progress);
+        else if (extension == ".off")
+            readOff(path, &points, &normals, &faces, &progress);
+        else if (extension == ".ply")
+            readPly(path, &points, &normals, &faces, &progress);
+        asset.droppedFaces = progress.droppedFaces;
+        if (progress.cancelled() || points.empty())
+            return asset;
+        reorderAlongCurve(pointOrder, &points, &normals, &faces);
+        progress.done = progress.total.load();
+        progress.indexing = true;
+        // neither the snapshot checksum nor the build can be interrupted, so check before each
+        if (progress.cancelled())
+            return asset;
+        if (meshCacheEnabled && pointOrder != CurveOrder::None)
+            asset.sds = loadTreeSnapshot(path, points);
+        if (!asset.sds && !progress.cancelled())
+        {
+            asset.sds = std::make_unique<SpatialDataStructure>(points);
+            if (meshCacheWrite && pointOrder == CurveOrder::None)
+                saveCachedMesh(path, *asset.sds, normals, faces, asset.droppedFaces);
+            else if (meshCacheWrite)
+                saveTreeSnapshot(path, *asset.sds);
+        }
+        asset.points = std::move(points);
+        asset.normals = std::move(normals);
+        asset.faces = std::move(faces);
+        return asset;
+    }
+};
+
+AssetLoader assetLoader;
+// the loaded geometry, viewed in the file's cache mapping when it was loaded from one
+MappedArray<Point> points;
+MappedArray<std::array<int,3>> edges;
 
 void callback()
 {
@@ -1602,14 +6902,23 @@ void callback()
     static float diagonal;
     //static float h;
     static int cube = 0;
-    if (ImGui::Button("Load Off"))
+    if (assetLoader.busy())
+    {
+        LoadProgress const &progress = assetLoader.progress();
+        ImGui::ProgressBar(progress.fraction(), ImVec2(200, 0), progress.indexing ? "building index" : nullptr);
+        ImGui::SameLine();
+        if (ImGui::Button("Cancel"))
+            assetLoader.cancel();
+    }
+    else if (ImGui::Button("Load Off"))
     {
         //auto paths = pfd::open_file("Load Off", "", std::vector<std::string>{"point data (*.off)", "*.off"}, pfd::opt::none).result();
-        auto paths2 = pfd::open_file("Load Off", "", std::vector<std::string>{"mesh data (*.obj)", "*.obj"}, pfd::opt::none).result();
+        auto paths2 = pfd::open_file("Load Off", "", std::vector<std::string>{"mesh data (*.obj *.off *.ply)", "*.obj *.off *.ply"}, pfd::opt::none).result();
         if (!paths2.empty())
         {
             //std::filesystem::path path(paths[0]);
-            std::filesystem::path path2(paths2[0]);
+            // parsing and building the spatial data structure run on the loader thread
+            assetLoader.start(paths2[0]);
             /*if (path.extension() == ".off")
             {
                 // Read the point cloud
@@ -1636,18 +6945,52 @@ void callback()
                 marchingCubes(Nx, Ny, Nz, radius, h);
                 polygon->setEnabled(pVis);
             }*/
-            if (path2.extension() == ".obj"){
-                points.clear();
-                edges.clear();
-                readOffobj(path2.string(), &points, &edges);
-                
-                
-                pc = polyscope::registerPointCloud("Points",points);
+        }
+    }
+    if (assetLoader.ready())
+    {
+        LoadedAsset asset = assetLoader.take();
+        if (asset.sds)
+        {
+            points = std::move(asset.points);
+            normals = std::move(asset.normals);
+            edges = std::move(asset.faces);
+            sds = std::move(asset.sds);
+            clearConstraints();
+
+            pc = polyscope::registerPointCloud("Points",points);
+            if (!normals.empty())
+                pc->addVectorQuantity("normals", normals);
+            if (!edges.empty())
                 polygon = polyscope::registerSurfaceMesh("Mesh",points,edges);
-                sds = std::make_unique<SpatialDataStructure>(points);
-            }
+            if (asset.droppedFaces > 0)
+                polyscope::warning(std::to_string(asset.droppedFaces) + " faces with invalid vertex indices were dropped from " + asset.path);
+        }
+        else if (!asset.path.empty())
+            polyscope::warning("could not load " + asset.path);
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Save PLY"))
+    {
+        auto path = pfd::save_file("Save PLY", "", std::vector<std::string>{"binary PLY (*.ply)", "*.ply"}).result();
+        if (!path.empty())
+        {
+            // the last marching cubes surface if there is one, otherwise the loaded mesh
+            bool ok = !surfaceFaces.empty() ? writePly<std::size_t>(path, surfacePoints, surfaceNormals, surfaceFaces)
+                                            : writePly<int>(path, points, normals, edges);
+            if (!ok)
+                polyscope::warning("could not write " + path);
         }
     }
+    ImGui::SameLine();
+    // the file is chosen up front so marching cubes writes it while extracting
+    if (surfaceStreamPath.empty())
+    {
+        if (ImGui::Button("Stream surface to..."))
+            surfaceStreamPath = pfd::save_file("Stream surface to", "", std::vector<std::string>{"mesh data (*.obj *.off *.ply)", "*.obj *.off *.ply"}).result();
+    }
+    else if (ImGui::Button("Stop streaming"))
+        surfaceStreamPath.clear();
     static int iteration = 0;
     static float h = 0.005;
     static bool EorI = false;
@@ -1662,6 +7005,45 @@ void callback()
         polygon = polyscope::registerSurfaceMesh("Mesh",cotLaplacianSmoothing(points,edges,iteration,h,EorI),edges);
     }
 
+    // MLS surface of the loaded points, the constraint points are computed once per cloud
+    static bool extended = false;
+    static const char *backends[] = {"kdtree", "grid", "octree", "dynamic", "chunked"};
+    int backend = (int)constraintBackend;
+    if (ImGui::Combo("index", &backend, backends, IM_ARRAYSIZE(backends)))
+    {
+        constraintBackend = (IndexBackend)backend;
+        clearConstraints();
+    }
+    if (ImGui::Checkbox("quantized constraint points", &useQuantizedStore))
+        clearConstraints();
+    ImGui::SliderInt("Nx", &Nx, 1, 100);
+    ImGui::SliderInt("Ny", &Ny, 1, 100);
+    ImGui::SliderInt("Nz", &Nz, 1, 100);
+    ImGui::SliderFloat("R", &radius, 0.0, 150.0);
+    ImGui::SliderFloat("R low_scale", &radius, 0.0, 0.5);
+    ImGui::Checkbox("extended marching cubes", &extended);
+    if (ImGui::Button("Reconstruct surface"))
+    {
+        if (!sds || sds->getPoints().empty() || normals.size() != sds->getPoints().size())
+            polyscope::warning("reconstruction needs a point cloud with normals");
+        else
+        {
+            diagonal = gridGernate(Nx, Ny, Nz);
+            if (n_3.empty())
+                n3(diagonal);
+            if (ImplicitValue(radius, diagonal / 10.0))
+                extractSurface(Nx, Ny, Nz, radius, diagonal / 10.0, extended);
+            else
+            {
+                polyscope::warning("chunks of the constraint index could not be restored from its spill file");
+                clearConstraints();
+            }
+        }
+    }
+    if (approxNearestLookups > 0)
+        ImGui::Text("%zu approximate nearest-point lookups, distance error at most %.2f%% (epsilon %.2f%%)", approxNearestLookups.load(),
+                    approxNearestError.load() * 100, nearestEpsilon * 100);
+
 
     /*if (ImGui::Checkbox("BoundingBox", &BoxVis))
     {
@@ -1682,30 +7064,30 @@ void callback()
     {
         diagonal = gridGernate(Nx, Ny, Nz);
         ImplicitValue(radius, h);
-        marchingCubes(Nx, Ny, Nz, radius, h);
+        extractSurface(Nx, Ny, Nz, radius, h);
     }
     if (ImGui::SliderInt("Ny", &Ny, 0, 100))
     {
         diagonal = gridGernate(Nx, Ny, Nz);
         ImplicitValue(radius, h);
-        marchingCubes(Nx, Ny, Nz, radius, h);
+        extractSurface(Nx, Ny, Nz, radius, h);
     }
     if (ImGui::SliderInt("Nz", &Nz, 0, 100))
     {
         diagonal = gridGernate(Nx, Ny, Nz);
         ImplicitValue(radius, h);
-        marchingCubes(Nx, Ny, Nz, radius, h);
+        extractSurface(Nx, Ny, Nz, radius, h);
     }
 
     if (ImGui::SliderFloat("R", &radius, 0.0, 150.0))
     {
         ImplicitValue(radius, diagonal / 10.0);
-        marchingCubes(Nx, Ny, Nz, radius, diagonal / 10.0);
+        extractSurface(Nx, Ny, Nz, radius, diagonal / 10.0);
     };
     if (ImGui::SliderFloat("R low_scale", &radius, 0.0, 0.5))
     {
         ImplicitValue(radius, diagonal / 10.0);
-        marchingCubes(Nx, Ny, Nz, radius, diagonal / 10.0);
+        extractSurface(Nx, Ny, Nz, radius, diagonal / 10.0);
     };
     if (ImGui::SliderInt("Cube", &cube, 0, 100))
     {
@@ -1754,7 +7136,7 @@ void callback()
     
     /*static bool extended = false;
     if (ImGui::Checkbox("extended marching cubes",&extended)){
-        EmarchingCubes(Nx,Ny,Nz,radius,h);
+        extractSurface(Nx, Ny, Nz, radius, h, true);
     }*/
 
 
@@ -1993,10 +7375,792 @@ void callback()
     }*/
 }
 
+/*
+ * Benchmarks, run from the command line instead of the viewer
+ */
+template <typename F>
+double timeMs(F &&f, int repeats)
+{
+    double best = 1e30;
+    for (int r = 0; r < repeats; r++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto stop = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(stop - start).count());
+    }
+    return best;
+}
+
+/*
+ * Copy of a file in the temporary directory, removed together with the caches written for it,
+ * so benchmarks never leave files behind
+ */
+class ScratchCopy
+{
+public:
+    explicit ScratchCopy(std::string const &source)
+    {
+        std::error_code ec;
+        m_path = (std::filesystem::temp_directory_path(ec) / ("cg2-bench-" + std::filesystem::path(source).filename().string())).string();
+        std::filesystem::copy_file(source, m_path, std::filesystem::copy_options::overwrite_existing, ec);
+    }
+    ~ScratchCopy()
+    {
+        std::remove(m_path.c_str());
+        std::remove(MeshCache::pathFor(m_path).c_str());
+        std::remove(MeshCache::pathFor(m_path, ".cg2tree").c_str());
+    }
+    std::string const &path() const
+    {
+        return m_path;
+    }
+
+private:
+    std::string m_path;
+};
+
+void benchReadOff(std::string const &filename, int repeats = 5)
+{
+    // the readers are timed without reading or writing caches
+    const bool cacheEnabled = meshCacheEnabled, cacheWrite = meshCacheWrite;
+    meshCacheEnabled = meshCacheWrite = false;
+    PointList pointsA, pointsB;
+    std::vector<Normal> normalsA, normalsB;
+    double tStream = timeMs([&]
+                            { pointsA.clear(); normalsA.clear(); readOffStream(filename, &pointsA, &normalsA); }, repeats);
+    double tMapped = timeMs([&]
+                            { pointsB.clear(); normalsB.clear(); readOff(filename, &pointsB, &normalsB); }, repeats);
+    std::cout << filename << ": " << pointsB.size() << " points" << std::endl;
+    std::cout << "  ifstream  " << tStream << " ms" << std::endl;
+    std::cout << "  mmap      " << tMapped << " ms (" << tStream / tMapped << "x)" << std::endl;
+    if (pointsA != pointsB || normalsA != normalsB)
+        std::cout << "  WARNING: readers disagree" << std::endl;
+
+    meshCacheEnabled = cacheEnabled;
+    meshCacheWrite = cacheWrite;
+    if (meshCacheEnabled)
+    {
+        ScratchCopy copy(filename);
+        meshCacheWrite = true;
+        pointsA.clear();
+        normalsA.clear();
+        readOff(copy.path(), &pointsA, &normalsA);
+        meshCacheWrite = cacheWrite;
+        double tCached = timeMs([&]
+                                { pointsA.clear(); normalsA.clear(); readOff(copy.path(), &pointsA, &normalsA); }, repeats);
+        std::cout << "  cache     " << tCached << " ms (" << tStream / tCached << "x)" << std::endl;
+        if (pointsA != pointsB || normalsA != normalsB)
+            std::cout << "  WARNING: cache disagrees" << std::endl;
+    }
+}
+
+void benchReadOffobj(std::string const &filename, int repeats = 5)
+{
+    // the readers are timed without reading or writing caches
+    const bool cacheEnabled = meshCacheEnabled, cacheWrite = meshCacheWrite;
+    meshCacheEnabled = meshCacheWrite = false;
+    PointList pointsA, pointsB, pointsC;
+    std::vector<std::array<int, 3>> facesA, facesB, facesC;
+    double tStream = timeMs([&]
+                            { pointsA.clear(); facesA.clear(); readOffobjStream(filename, &pointsA, &facesA); }, repeats);
+    double tSerial = timeMs([&]
+                            { pointsB.clear(); facesB.clear(); readOffobj(filename, &pointsB, &facesB, 1); }, repeats);
+    double tParallel = timeMs([&]
+                              { pointsC.clear(); facesC.clear(); readOffobj(filename, &pointsC, &facesC); }, repeats);
+    std::cout << filename << ": " << pointsC.size() << " vertices, " << facesC.size() << " faces" << std::endl;
+    std::cout << "  istringstream  " << tStream << " ms" << std::endl;
+    std::cout << "  1 thread       " << tSerial << " ms (" << tStream / tSerial << "x)" << std::endl;
+    std::cout << "  " << std::thread::hardware_concurrency() << " threads      " << tParallel << " ms (" << tStream / tParallel << "x)" << std::endl;
+    if (pointsB != pointsC || facesB != facesC)
+        std::cout << "  WARNING: serial and parallel results differ" << std::endl;
+
+    meshCacheEnabled = cacheEnabled;
+    meshCacheWrite = cacheWrite;
+    if (meshCacheEnabled)
+    {
+        ScratchCopy copy(filename);
+        meshCacheWrite = true;
+        pointsA.clear();
+        facesA.clear();
+        readOffobj(copy.path(), &pointsA, &facesA);
+        meshCacheWrite = cacheWrite;
+        double tCached = timeMs([&]
+                                { pointsA.clear(); facesA.clear(); readOffobj(copy.path(), &pointsA, &facesA); }, repeats);
+        std::cout << "  cache          " << tCached << " ms (" << tStream / tCached << "x)" << std::endl;
+        if (pointsA != pointsC || facesA != facesC)
+            std::cout << "  WARNING: cache disagrees" << std::endl;
+    }
+}
+
+void benchChunkedIndex(std::string const &filename, std::size_t batchSize = 4096, int nQueries = 1000)
+{
+    PointList points;
+    // the reference reader needs somewhere to put the normals of a NOFF file
+    std::vector<Normal> normals;
+    std::unique_ptr<SpatialDataStructure> tree;
+    ChunkedSpatialIndex chunked;
+    ChunkedSpatialIndex spilled(ChunkedSpatialIndex::spillPathFor("cg2-bench-chunks"), 8);
+    double tFull = timeMs([&]
+                          { points.clear(); normals.clear(); readOffStream(filename, &points, &normals); tree = std::make_unique<SpatialDataStructure>(points); }, 1);
+    double tChunked = timeMs([&]
+                             { buildChunkedIndex(filename, chunked, batchSize); }, 1);
+    double tSpilled = timeMs([&]
+                             { buildChunkedIndex(filename, spilled, batchSize); }, 1);
+    std::cout << filename << ": " << chunked.size() << " points in " << chunked.chunkCount() << " chunks of " << batchSize << std::endl;
+    std::cout << "  read + build      " << tFull << " ms" << std::endl;
+    std::cout << "  streamed chunks   " << tChunked << " ms" << std::endl;
+    std::cout << "  spilled chunks    " << tSpilled << " ms" << std::endl;
+    if (points.empty())
+        return;
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<std::size_t> pick(0, points.size() - 1);
+    std::size_t mismatches = 0;
+    PointList queries(nQueries);
+    for (int q = 0; q < nQueries; q++)
+    {
+        Point p = queries[q] = points[pick(rng)];
+        std::vector<std::size_t> a = tree->collectInRadius(p, 0.01f), b = chunked.collectInRadius(p, 0.01f), e = spilled.collectInRadius(p, 0.01f);
+        std::vector<std::size_t> c = tree->collectKNearest(p, 8), d = chunked.collectKNearest(p, 8), f = spilled.collectKNearest(p, 8);
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        std::sort(e.begin(), e.end());
+        float farC = EuclideanDistance::measure(p, points[c.back()]), farD = EuclideanDistance::measure(p, points[d.back()]);
+        std::size_t nearestTree = 0, nearestSpilled = 0;
+        const bool withinTree = tree->nearestWithin(p, 0.01f, &nearestTree), withinSpilled = spilled.nearestWithin(p, 0.01f, &nearestSpilled);
+        if (a != b || farC != farD || b != e || d != f || spilled.countInRadius(p, 0.01f) != a.size() || spilled.anyInRadius(p, 0.01f) != !a.empty() ||
+            withinTree != withinSpilled || nearestTree != nearestSpilled)
+            mismatches++;
+    }
+    if (tree->collectInRadiusBatch(queries, 0.01f).indices.size() != spilled.collectInRadiusBatch(queries, 0.01f).indices.size() ||
+        spilled.collectKNearestBatch(queries, 8).indices.size() != queries.size() * std::min<std::size_t>(8, points.size()))
+        mismatches++;
+    std::cout << "  " << mismatches << " of " << nQueries << " queries differ from the monolithic tree" << std::endl;
+    std::cout << "  " << spilled.residentCount() << " of " << spilled.chunkCount() << " spilled chunks resident after the queries" << std::endl;
+    if (spilled.failed())
+        std::cout << "  WARNING: spilled chunks could not be restored" << std::endl;
+}
+
+void benchKNearest(std::string const &filename, int nQueries = 200)
+{
+    PointList points;
+    readOff(filename, &points);
+    if (points.empty())
+        return;
+    SpatialDataStructure tree(points);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<std::size_t> pick(0, points.size() - 1);
+    std::vector<Point> queries(nQueries);
+    for (Point &q : queries)
+        q = points[pick(rng)];
+
+    std::cout << filename << ": " << points.size() << " points, " << nQueries << " queries" << std::endl;
+    for (unsigned int k = 1; k <= 10000; k *= 10)
+    {
+        // the baseline sorts up to k + 1 candidates per point it looks at, so it only gets a share
+        // of the queries for large k; both are reported per query
+        const std::size_t nBaseline = std::clamp<std::size_t>(2000 / k, 1, queries.size());
+        std::vector<std::vector<std::size_t>> baseline(nBaseline);
+        double tHeap = timeMs([&]
+                              { for (Point const &q : queries) tree.collectKNearest(q, k); }, 1);
+        double tBaseline = timeMs([&]
+                                  { for (std::size_t i = 0; i < nBaseline; i++) baseline[i] = tree.collectKNearestBaseline(queries[i], k); }, 1);
+        std::size_t mismatches = 0;
+        for (std::size_t i = 0; i < nBaseline; i++)
+            mismatches += tree.collectKNearest(queries[i], k) != baseline[i];
+        tHeap /= queries.size();
+        tBaseline /= nBaseline;
+        std::cout << "  k = " << k << "\tmax-heap " << tHeap << " ms\tbaseline " << tBaseline << " ms per query (" << tBaseline / tHeap << "x)\t" << mismatches << " of "
+                  << nBaseline << " differ" << std::endl;
+    }
+}
+// grid queries as ImplicitValue issues them, with points and queries in file order and along each curve
+void benchCurveOrder(std::string const &filename, int gridSize = 64)
+{
+    PointList points;
+    readOff(filename, &points);
+    if (points.empty())
+        return;
+    Point lo = points[0], hi = points[0];
+    for (Point const &p : points)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            lo[axis] = std::min(lo[axis], p[axis]);
+            hi[axis] = std::max(hi[axis], p[axis]);
+        }
+    }
+    PointList grid;
+    for (int i = 0; i < gridSize; i++)
+    {
+        for (int j = 0; j < gridSize; j++)
+        {
+            for (int k = 0; k < gridSize; k++)
+                grid.push_back(Point{lo[0] + (hi[0] - lo[0]) * i / (gridSize - 1), lo[1] + (hi[1] - lo[1]) * j / (gridSize - 1),
+                                     lo[2] + (hi[2] - lo[2]) * k / (gridSize - 1)});
+        }
+    }
+    const float radius = 0.02f * std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+
+    std::cout << filename << ": " << points.size() << " points, " << grid.size() << " grid queries" << std::endl;
+    const char *names[] = {"file order", "morton", "hilbert"};
+    for (CurveOrder order : {CurveOrder::None, CurveOrder::Morton, CurveOrder::Hilbert})
+    {
+        PointList sortedPoints = points;
+        reorderAlongCurve(order, &sortedPoints);
+        const std::vector<std::size_t> permutation = curvePermutation(grid, order);
+        PointList queries(grid.size());
+        for (std::size_t i = 0; i < grid.size(); i++)
+            queries[i] = grid[permutation[i]];
+        // stands in for functionVal, which the MLS sum reads for every neighbour
+        std::vector<float> values(sortedPoints.size());
+        for (std::size_t i = 0; i < values.size(); i++)
+            values[i] = sortedPoints[i][0];
+
+        SpatialDataStructure tree(sortedPoints);
+        double sum = 0;
+        double tQuery = timeMs([&]
+                               {
+            NeighborLists found = tree.collectInRadiusBatch(queries, radius, false, 1);
+            for (std::size_t idx : found.indices)
+                sum += values[idx]; }, 3);
+        std::cout << "  " << names[(int)order] << "\t" << tQuery << " ms (checksum " << sum << ")" << std::endl;
+    }
+}
+// path itself, or the OFF files in it if it is a directory
+std::vector<std::string> offFiles(std::string const &path)
+{
+    std::vector<std::string> files;
+    if (!std::filesystem::is_directory(path))
+        return {path};
+    for (auto const &entry : std::filesystem::directory_iterator(path))
+    {
+        if (entry.path().extension() == ".off")
+            files.push_back(entry.path().string());
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+/*
+ * Radius and nearest-point queries on the kd-tree and on the uniform grid built for the radius, for
+ * one OFF file or every OFF file in a directory
+ */
+void benchGridIndex(std::string const &path, int nQueries = 20000)
+{
+    for (std::string const &filename : offFiles(path))
+    {
+        PointList points;
+        readOff(filename, &points);
+        if (points.empty())
+            continue;
+        Point lo = points[0], hi = points[0];
+        for (Point const &p : points)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                lo[axis] = std::min(lo[axis], p[axis]);
+                hi[axis] = std::max(hi[axis], p[axis]);
+            }
+        }
+        const float extent = std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+        // query points near the surface, like the MLS grid vertices close to it
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<std::size_t> pick(0, points.size() - 1);
+        std::uniform_real_distribution<float> jitter(-0.02f * extent, 0.02f * extent);
+        PointList queries(nQueries);
+        for (Point &q : queries)
+        {
+            q = points[pick(rng)];
+            for (int axis = 0; axis < 3; axis++)
+                q[axis] += jitter(rng);
+        }
+
+        std::unique_ptr<SpatialDataStructure> tree;
+        std::unique_ptr<UniformGridIndex> grid;
+        double tTree = timeMs([&]
+                              { tree = std::make_unique<SpatialDataStructure>(points); }, 1);
+        double tGrid = timeMs([&]
+                              { grid = std::make_unique<UniformGridIndex>(points, 0.01f * extent); }, 1);
+        std::cout << filename << ": " << points.size() << " points, " << nQueries << " queries, build " << tTree << " ms kd-tree vs. " << tGrid << " ms grid" << std::endl;
+        for (float fraction : {0.005f, 0.01f, 0.02f, 0.05f})
+        {
+            const float radius = fraction * extent;
+            grid->setRadius(radius);
+            std::size_t foundTree = 0, foundGrid = 0;
+            tTree = timeMs([&]
+                           { foundTree = tree->collectInRadiusBatch(queries, radius, false, 1).indices.size(); }, 3);
+            tGrid = timeMs([&]
+                           { foundGrid = grid->collectInRadiusBatch(queries, radius, false, 1).indices.size(); }, 3);
+            std::cout << "  radius " << fraction << " * extent\t" << tTree << " ms kd-tree vs. " << tGrid << " ms grid\t"
+                      << (tTree <= tGrid ? "kd-tree" : "grid") << " wins" << (foundTree == foundGrid ? "" : ", results differ") << std::endl;
+        }
+        grid->setRadius(0.01f * extent);
+        tTree = timeMs([&]
+                       { tree->collectKNearestBatch(queries, 1, false, 1); }, 3);
+        tGrid = timeMs([&]
+                       { grid->collectKNearestBatch(queries, 1, false, 1); }, 3);
+        std::cout << "  nearest point\t\t" << tTree << " ms kd-tree vs. " << tGrid << " ms grid\t" << (tTree <= tGrid ? "kd-tree" : "grid") << " wins" << std::endl;
+    }
+}
+/*
+ * Radius queries with neighbourhoods of hundreds to thousands of points on the kd-tree and the
+ * octree, collecting indices only (octree nodes inside the ball are copied whole) and summing
+ * distance weights like functionValue
+ */
+void benchOctreeIndex(std::string const &path, int nQueries = 2000)
+{
+    for (std::string const &filename : offFiles(path))
+    {
+        PointList points;
+        readOff(filename, &points);
+        if (points.empty())
+            continue;
+        Point lo = points[0], hi = points[0];
+        for (Point const &p : points)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                lo[axis] = std::min(lo[axis], p[axis]);
+                hi[axis] = std::max(hi[axis], p[axis]);
+            }
+        }
+        const float extent = std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<std::size_t> pick(0, points.size() - 1);
+        PointList queries(nQueries);
+        for (Point &q : queries)
+            q = points[pick(rng)];
+
+        std::unique_ptr<SpatialDataStructure> tree;
+        std::unique_ptr<OctreeIndex> octree;
+        double tTree = timeMs([&]
+                              { tree = std::make_unique<SpatialDataStructure>(points); }, 1);
+        double tOctree = timeMs([&]
+                                { octree = std::make_unique<OctreeIndex>(points); }, 1);
+        std::cout << filename << ": " << points.size() << " points, " << nQueries << " queries, build " << tTree << " ms kd-tree vs. " << tOctree
+                  << " ms octree (" << octree->nodeCount() << " nodes)" << std::endl;
+        for (float fraction : {0.05f, 0.1f, 0.2f})
+        {
+            const float radius = fraction * extent;
+            std::size_t foundTree = 0, foundOctree = 0;
+            tTree = timeMs([&]
+                           { foundTree = tree->collectInRadiusBatch(queries, radius, false, 1).indices.size(); }, 3);
+            tOctree = timeMs([&]
+                             { foundOctree = octree->collectInRadiusBatch(queries, radius, false, 1).indices.size(); }, 3);
+            double sumTree = 0, sumOctree = 0;
+            auto weighTree = [&](std::size_t, Point const &, float squaredDistance)
+            { sumTree += weightAtDistance(std::sqrt(squaredDistance), radius); };
+            auto weighOctree = [&](std::size_t, Point const &, float squaredDistance)
+            { sumOctree += weightAtDistance(std::sqrt(squaredDistance), radius); };
+            double tWeightTree = timeMs([&]
+                                        { for (Point const &q : queries) tree->forEachInRadius(q, radius, weighTree); }, 1);
+            double tWeightOctree = timeMs([&]
+                                          { for (Point const &q : queries) octree->forEachInRadius(q, radius, weighOctree); }, 1);
+            std::cout << "  radius " << fraction << " * extent, " << foundTree / nQueries << " neighbours\tindices " << tTree << " ms kd-tree vs. " << tOctree
+                      << " ms octree\tweights " << tWeightTree << " ms vs. " << tWeightOctree << " ms" << (foundTree == foundOctree ? "" : ", results differ") << std::endl;
+        }
+    }
+}
+/*
+ * Nodes the kd-tree enters per radius and kNN query with the per-node boxes and with the split
+ * planes alone, for one OFF file or every OFF file in a directory
+ */
+void benchBoxPruning(std::string const &path, int nQueries = 20000)
+{
+    for (std::string const &filename : offFiles(path))
+    {
+        PointList points;
+        readOff(filename, &points);
+        if (points.empty())
+            continue;
+        Point lo = points[0], hi = points[0];
+        for (Point const &p : points)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                lo[axis] = std::min(lo[axis], p[axis]);
+                hi[axis] = std::max(hi[axis], p[axis]);
+            }
+        }
+        const float extent = std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<std::size_t> pick(0, points.size() - 1);
+        std::uniform_real_distribution<float> jitter(-0.02f * extent, 0.02f * extent);
+        PointList queries(nQueries);
+        for (Point &q : queries)
+        {
+            q = points[pick(rng)];
+            for (int axis = 0; axis < 3; axis++)
+                q[axis] += jitter(rng);
+        }
+
+        SpatialDataStructure tree(points);
+        std::cout << filename << ": " << points.size() << " points, " << nQueries << " queries, nodes visited per query" << std::endl;
+        // prints the averages after the label of the line
+        auto report = [&](auto const &visit)
+        {
+            double planes = 0, boxes = 0;
+            for (Point const &q : queries)
+            {
+                planes += visit(q, false);
+                boxes += visit(q, true);
+            }
+            std::cout << "\t" << planes / nQueries << " split planes vs. " << boxes / nQueries << " boxes\t("
+                      << (boxes > 0 ? planes / boxes : 0.0) << "x fewer)" << std::endl;
+        };
+        for (float fraction : {0.005f, 0.01f, 0.05f})
+        {
+            std::cout << "  radius " << fraction << " * extent";
+            report([&](Point const &q, bool useBoxes)
+                   { return tree.visitedNodesInRadius(q, fraction * extent, useBoxes); });
+        }
+        for (unsigned int k : {1u, 10u, 100u})
+        {
+            std::cout << "  k = " << k << "\t\t";
+            report([&](Point const &q, bool useBoxes)
+                   { return tree.visitedNodesKNearest(q, k, useBoxes); });
+        }
+    }
+}
+/*
+ * Nearest-point queries like the MLS lookups outside the radius, exact and (1 + epsilon)-approximate,
+ * with the measured distance error against the exact search and the error the search guarantees
+ */
+void benchApproxNearest(std::string const &filename, int nQueries = 20000)
+{
+    PointList points;
+    readOff(filename, &points);
+    if (points.empty())
+        return;
+    Point lo = points[0], hi = points[0];
+    for (Point const &p : points)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            lo[axis] = std::min(lo[axis], p[axis]);
+            hi[axis] = std::max(hi[axis], p[axis]);
+        }
+    }
+    // grid vertices spread over the bounding box enlarged by 10%, most of them away from the surface
+    std::mt19937 rng(42);
+    PointList queries(nQueries);
+    for (Point &q : queries)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float margin = 0.1f * (hi[axis] - lo[axis]);
+            q[axis] = std::uniform_real_distribution<float>(lo[axis] - margin, hi[axis] + margin)(rng);
+        }
+    }
+
+    SpatialDataStructure tree(points);
+    std::vector<float> exact(nQueries);
+    double tExact = timeMs([&]
+                           { for (Point const &q : queries) tree.collectKNearest(q, 1); }, 3);
+    for (int i = 0; i < nQueries; i++)
+    {
+        std::vector<float> distance;
+        tree.collectKNearest(queries[i], 1, &distance);
+        exact[i] = distance[0];
+    }
+    std::cout << filename << ": " << points.size() << " points, " << nQueries << " queries, exact " << tExact << " ms" << std::endl;
+    for (float epsilon : {0.05f, 0.1f, 0.25f, 0.5f, 1.0f})
+    {
+        double tApprox = timeMs([&]
+                                { for (Point const &q : queries) tree.collectKNearestApprox(q, 1, epsilon); }, 3);
+        double sumError = 0;
+        float maxError = 0, maxGuaranteed = 0;
+        int different = 0;
+        for (int i = 0; i < nQueries; i++)
+        {
+            std::vector<float> distance;
+            float guaranteed = 0;
+            tree.collectKNearestApprox(queries[i], 1, epsilon, &distance, &guaranteed);
+            const float error = exact[i] > 0 ? distance[0] / exact[i] - 1 : 0.0f;
+            sumError += error;
+            maxError = std::max(maxError, error);
+            maxGuaranteed = std::max(maxGuaranteed, guaranteed);
+            different += distance[0] != exact[i];
+        }
+        std::cout << "  epsilon " << epsilon << "\t" << tApprox << " ms (" << tExact / tApprox << "x)\t" << different << " not the nearest, error mean "
+                  << sumError / nQueries * 100 << "% max " << maxError * 100 << "%, guaranteed " << maxGuaranteed * 100 << "%" << std::endl;
+    }
+}
+/*
+ * Editing a cloud with the dynamic index against rebuilding a SpatialDataStructure: inserting the
+ * points one by one, streaming them in batches of 1%, erasing 10% of them, and queries afterwards
+ */
+void benchDynamicIndex(std::string const &filename, int nQueries = 20000)
+{
+    PointList points;
+    readOff(filename, &points);
+    if (points.empty())
+        return;
+    const std::size_t n = points.size();
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<std::size_t> pick(0, n - 1);
+    PointList queries(nQueries);
+    for (Point &q : queries)
+        q = points[pick(rng)];
+
+    std::unique_ptr<SpatialDataStructure> tree;
+    double tBuild = timeMs([&]
+                           { tree = std::make_unique<SpatialDataStructure>(points); }, 3);
+    std::cout << filename << ": " << n << " points, rebuilding the kd-tree takes " << tBuild << " ms" << std::endl;
+
+    std::unique_ptr<DynamicSpatialIndex> dynamic;
+    double tInsert = timeMs([&]
+                            {
+        dynamic = std::make_unique<DynamicSpatialIndex>();
+        for (Point const &p : points)
+            dynamic->insert(p); }, 1);
+    std::cout << "  insert one by one   " << tInsert << " ms, " << tInsert * 1000 / n << " us per point" << std::endl;
+
+    const std::size_t batch = std::max<std::size_t>(1, n / 100);
+    double tStream = timeMs([&]
+                            {
+        dynamic = std::make_unique<DynamicSpatialIndex>();
+        for (std::size_t first = 0; first < n; first += batch)
+            dynamic->insert(ArrayView<Point>(points.data() + first, std::min(batch, n - first))); }, 1);
+    std::cout << "  batches of " << batch << "\t" << tStream / ((n + batch - 1) / batch) << " ms per batch vs. " << tBuild << " ms rebuild" << std::endl;
+
+    std::vector<std::size_t> victims(n);
+    std::iota(victims.begin(), victims.end(), 0);
+    std::shuffle(victims.begin(), victims.end(), rng);
+    victims.resize(n / 10);
+    double tErase = timeMs([&]
+                           {
+        for (std::size_t id : victims)
+            dynamic->erase(id); }, 1);
+    std::cout << "  erase 10%           " << tErase * 1000 / victims.size() << " us per point" << std::endl;
+
+    PointList remaining;
+    std::vector<bool> erased(n, false);
+    for (std::size_t id : victims)
+        erased[id] = true;
+    for (std::size_t i = 0; i < n; i++)
+    {
+        if (!erased[i])
+            remaining.push_back(points[i]);
+    }
+    tree = std::make_unique<SpatialDataStructure>(remaining);
+    Point lo = points[0], hi = points[0];
+    for (Point const &p : points)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            lo[axis] = std::min(lo[axis], p[axis]);
+            hi[axis] = std::max(hi[axis], p[axis]);
+        }
+    }
+    const float radius = 0.01f * std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+    std::size_t foundTree = 0, foundDynamic = 0;
+    double tTree = timeMs([&]
+                          { foundTree = tree->collectInRadiusBatch(queries, radius, false, 1).indices.size(); }, 3);
+    double tDynamic = timeMs([&]
+                             { foundDynamic = dynamic->collectInRadiusBatch(queries, radius, false, 1).indices.size(); }, 3);
+    std::cout << "  radius queries      " << tTree << " ms kd-tree vs. " << tDynamic << " ms dynamic" << (foundTree == foundDynamic ? "" : ", results differ") << std::endl;
+    tTree = timeMs([&]
+                   { tree->collectKNearestBatch(queries, 10, false, 1); }, 3);
+    tDynamic = timeMs([&]
+                      { dynamic->collectKNearestBatch(queries, 10, false, 1); }, 3);
+    std::cout << "  10 nearest          " << tTree << " ms kd-tree vs. " << tDynamic << " ms dynamic" << std::endl;
+
+    // copies of one point inserted before and after flushes, the oldest has to win every tie
+    DynamicSpatialIndex twins;
+    const std::size_t copies = 4;
+    for (std::size_t i = 0; i < copies * DynamicSpatialIndex::bufferSize; i++)
+        twins.insert(i % DynamicSpatialIndex::bufferSize == 0 ? lo : Point{hi[0] + (float)i, hi[1], hi[2]});
+    std::size_t nearest = 0;
+    std::vector<std::size_t> expected(copies);
+    for (std::size_t i = 0; i < copies; i++)
+        expected[i] = i * DynamicSpatialIndex::bufferSize;
+    if (!twins.nearestWithin(lo, radius, &nearest) || nearest != 0 || twins.collectKNearest(lo, 1)[0] != 0 || twins.collectKNearest(lo, copies) != expected)
+        std::cout << "  WARNING: ties between duplicate points do not go to the smaller id" << std::endl;
+
+    // a line of points erased down to two, every kNN search has to return just those two
+    PointList line(1000);
+    for (std::size_t i = 0; i < line.size(); i++)
+        line[i] = Point{(float)i, 0.0f, 0.0f};
+    SpatialDataStructure sparse(line);
+    for (std::size_t i = 0; i + 2 < line.size(); i++)
+        sparse.erase(i);
+    const Point origin{0.0f, 0.0f, 0.0f};
+    const std::vector<std::size_t> survivors{line.size() - 2, line.size() - 1};
+    std::vector<float> survivorDistances;
+    const bool exact = sparse.collectKNearest(origin, 5, &survivorDistances) == survivors && survivorDistances.size() == 2 && std::isfinite(survivorDistances[1]);
+    if (!exact || sparse.collectKNearestBatch(ArrayView<Point>(&origin, 1), 5).indices != survivors ||
+        sparse.collectKNearestApprox(origin, 5, 0.5f) != survivors || sparse.collectKNearestBaseline(origin, 5) != survivors)
+        std::cout << "  WARNING: kNN queries return erased points" << std::endl;
+}
+// building the kd-tree against restoring it from a snapshot, checksum of the source included, and
+// against mapping it from the .cg2cache
+void benchTreeSnapshot(std::string const &source, int nQueries = 20000)
+{
+    PointList points;
+    readOff(source, &points);
+    if (points.empty())
+        return;
+    // the snapshot is written for a scratch copy and removed with it
+    ScratchCopy copy(source);
+    std::string const &filename = copy.path();
+    std::unique_ptr<SpatialDataStructure> built, restored;
+    double tBuild = timeMs([&]
+                           { built = std::make_unique<SpatialDataStructure>(points); }, 3);
+    double tSave = timeMs([&]
+                          { saveTreeSnapshot(filename, *built); }, 1);
+    std::uint64_t checksum = 0;
+    double tChecksum = timeMs([&]
+                              { fileChecksum(filename, &checksum); }, 3);
+    double tLoad = timeMs([&]
+                          { restored = loadTreeSnapshot(filename, points); }, 3);
+    std::cout << source << ": " << points.size() << " points" << std::endl;
+    std::cout << "  build        " << tBuild << " ms" << std::endl;
+    std::cout << "  save         " << tSave << " ms to " << MeshCache::pathFor(filename, ".cg2tree") << std::endl;
+    if (!restored)
+    {
+        std::cout << "  WARNING: snapshot could not be restored" << std::endl;
+        return;
+    }
+    std::cout << "  restore      " << tLoad << " ms (" << tBuild / tLoad << "x), " << tChecksum << " ms of it the source checksum" << std::endl;
+
+    // the mapping outlives the MappedMesh through the tree
+    std::unique_ptr<SpatialDataStructure> mapped;
+    if (saveCachedMesh(filename, *built, {}, {}, 0))
+        tLoad = timeMs([&]
+                       { MappedMesh cached; mapped = cached.open(filename) ? loadCachedTree(cached) : nullptr; }, 3);
+    if (!mapped)
+        std::cout << "  WARNING: tree could not be mapped from the cache" << std::endl;
+    else
+        std::cout << "  map cache    " << tLoad << " ms (" << tBuild / tLoad << "x)" << std::endl;
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<std::size_t> pick(0, points.size() - 1);
+    PointList queries(nQueries);
+    for (Point &q : queries)
+        q = points[pick(rng)];
+    NeighborLists a = built->collectKNearestBatch(queries, 10, true), b = restored->collectKNearestBatch(queries, 10, true);
+    if (a.indices != b.indices || a.distances != b.distances)
+        std::cout << "  WARNING: restored tree answers differently" << std::endl;
+    if (mapped)
+    {
+        b = mapped->collectKNearestBatch(queries, 10, true);
+        if (a.indices != b.indices || a.distances != b.distances)
+            std::cout << "  WARNING: mapped tree answers differently" << std::endl;
+    }
+}
+void benchQuantizedIndex(std::string const &filename, int nQueries = 1000)
+{
+    PointList points;
+    std::vector<Normal> normals;
+    readOff(filename, &points, &normals);
+    if (points.empty())
+        return;
+    std::unique_ptr<SpatialDataStructure> tree;
+    std::unique_ptr<QuantizedSpatialIndex> quantized;
+    double tTree = timeMs([&]
+                          { tree = std::make_unique<SpatialDataStructure>(points); }, 1);
+    double tQuantized = timeMs([&]
+                               { quantized = std::make_unique<QuantizedSpatialIndex>(points); }, 1);
+    // the float tree keeps the input points besides its own arrays
+    std::size_t treeBytes = points.size() * sizeof(Point);
+    for (MeshCache::Blob const &blob : tree->snapshotSections())
+        treeBytes += blob.count * blob.elementSize;
+    const QuantizedPointList store(points, normals.empty() ? nullptr : &normals);
+    std::cout << filename << ": " << points.size() << " points" << std::endl;
+    std::cout << "  float kd-tree     " << treeBytes << " bytes (" << (float)treeBytes / points.size() << " per point), build " << tTree << " ms" << std::endl;
+    std::cout << "  quantized tree    " << quantized->memoryBytes() << " bytes (" << (float)quantized->memoryBytes() / points.size() << " per point), build "
+              << tQuantized << " ms" << std::endl;
+    std::cout << "  point store       " << points.size() * sizeof(Point) + normals.size() * sizeof(Normal) << " bytes float vs. " << store.memoryBytes()
+              << " bytes quantized" << std::endl;
+
+    float maxError = 0.0f, maxNormalError = 0.0f;
+    PointList decoded(points.size());
+    for (std::size_t i = 0; i < points.size(); i++)
+    {
+        decoded[i] = store.point(i);
+        maxError = std::max(maxError, EuclideanDistance::measure(points[i], decoded[i]));
+        if (store.hasNormals())
+        {
+            Normal n = normals[i], m = store.normal(i);
+            float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if (length > 0.0f)
+                maxNormalError = std::max(maxNormalError, std::acos(std::clamp((n[0] * m[0] + n[1] * m[1] + n[2] * m[2]) / length, -1.0f, 1.0f)));
+        }
+    }
+    std::cout << "  max position error " << maxError << ", max normal error " << maxNormalError * 180.0f / 3.14159265f << " deg" << std::endl;
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<std::size_t> pick(0, points.size() - 1);
+    std::vector<Point> queries(nQueries);
+    for (Point &q : queries)
+        q = points[pick(rng)];
+    const float radius = 0.01f;
+    std::size_t foundTree = 0, foundQuantized = 0, sameNearest = 0;
+    double tQueryTree = timeMs([&]
+                               { for (Point const &q : queries) foundTree += tree->collectInRadius(q, radius).size(); }, 3);
+    double tQueryQuantized = timeMs([&]
+                                    { for (Point const &q : queries) foundQuantized += quantized->collectInRadius(q, radius).size(); }, 3);
+    double tKnnTree = timeMs([&]
+                             { for (Point const &q : queries) tree->collectKNearest(q, 10); }, 3);
+    double tKnnQuantized = timeMs([&]
+                                  { for (Point const &q : queries) quantized->collectKNearest(q, 10); }, 3);
+    for (Point const &q : queries)
+        sameNearest += tree->collectKNearest(q, 1)[0] == quantized->collectKNearest(q, 1)[0];
+    std::cout << "  radius queries    " << tQueryTree << " ms vs. " << tQueryQuantized << " ms quantized" << std::endl;
+    std::cout << "  10 nearest        " << tKnnTree << " ms vs. " << tKnnQuantized << " ms quantized" << std::endl;
+    std::cout << "  neighbours found  " << foundTree / 3 << " vs. " << foundQuantized / 3 << ", same nearest point for " << sameNearest << " of " << nQueries << " queries" << std::endl;
+
+    // against a float tree over the decoded points the answers may only differ by rounding: in
+    // points right at the radius and in the order of equally distant neighbours
+    SpatialDataStructure reference(decoded);
+    float tolerance = 0.0f;
+    for (Point const &p : decoded)
+        tolerance = std::max({tolerance, std::fabs(p[0]), std::fabs(p[1]), std::fabs(p[2])});
+    tolerance *= 1e-5f;
+    std::size_t mismatches = 0;
+    for (Point const &q : queries)
+    {
+        std::vector<std::size_t> a = reference.collectInRadius(q, radius), b = quantized->collectInRadius(q, radius), onlyOne;
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        std::set_symmetric_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(onlyOne));
+        bool differs = std::any_of(onlyOne.begin(), onlyOne.end(), [&](std::size_t idx)
+                                   { return std::fabs(EuclideanDistance::measure(q, decoded[idx]) - radius) > tolerance; });
+        std::vector<float> da, db;
+        reference.collectKNearest(q, 10, &da);
+        quantized->collectKNearest(q, 10, &db);
+        differs = differs || da.size() != db.size();
+        for (std::size_t i = 0; !differs && i < da.size(); i++)
+            differs = std::fabs(da[i] - db[i]) > tolerance;
+        mismatches += differs;
+    }
+    if (mismatches > 0)
+        std::cout << "  WARNING: " << mismatches << " queries differ from a float tree over the decoded points" << std::endl;
+}
 int main(int argc, char **argv)
 {
     // Configure the argument parser
     args::ArgumentParser parser("Computer Graphics 2 Sample Code.");
+    args::ValueFlag<std::string> benchChunked(parser, "file", "Compare the streamed chunked index with a single tree and exit", {"bench-chunked"});
+    args::ValueFlag<std::string> benchKnn(parser, "file", "Time kNN queries for k = 1 ... 10000 against the baseline search and exit", {"bench-knn"});
+    args::ValueFlag<std::string> benchQuantized(parser, "file", "Compare the 16-bit quantized kd-tree and point store with the float kd-tree and exit", {"bench-quantized"});
+    args::ValueFlag<std::string> benchReorder(parser, "file", "Time grid radius queries with points and queries in file, Morton and Hilbert order and exit", {"bench-reorder"});
+    args::ValueFlag<std::string> reorder(parser, "curve", "Sort loaded points and query batches along a morton or hilbert curve", {"reorder"});
+    args::ValueFlag<std::string> benchGrid(parser, "path", "Compare the uniform grid with the kd-tree on an OFF file or every OFF file in a directory and exit", {"bench-grid"});
+    args::ValueFlag<std::string> benchOctree(parser, "path", "Compare the octree with the kd-tree on large-radius queries for an OFF file or every OFF file in a directory and exit", {"bench-octree"});
+    args::ValueFlag<std::string> benchBoxes(parser, "path", "Count the kd-tree nodes radius and kNN queries visit with box and with split-plane pruning for an OFF file or every OFF file in a directory and exit", {"bench-boxes"});
+    args::ValueFlag<std::string> benchApprox(parser, "file", "Time (1 + epsilon)-approximate nearest-point queries against exact ones with their errors and exit", {"bench-approx"});
+    args::ValueFlag<float> approxNearest(parser, "epsilon", "Let the kd-tree return a point at most 1 + epsilon times farther than the nearest for the viewer's MLS grid vertices outside the radius", {"approx-nn"});
+    args::ValueFlag<std::string> benchDynamic(parser, "file", "Time inserting and erasing points in the dynamic index against rebuilding the kd-tree and exit", {"bench-dynamic"});
+    args::ValueFlag<std::string> benchSnapshot(parser, "file", "Time restoring the kd-tree from its .cg2tree snapshot and mapping it from the .cg2cache against building it and exit", {"bench-snapshot"});
+    args::ValueFlag<std::string> indexBackend(parser, "index", "Spatial index the viewer's MLS reconstruction builds over the constraint points: kdtree (default), grid, octree, dynamic or chunked", {"index"});
+    args::Flag quantized(parser, "quantized", "Keep the constraint points of the viewer's MLS reconstruction in the 16-bit quantized kd-tree", {"quantized"});
+    args::Flag noCache(parser, "no-cache", "Always parse OFF/OBJ files and build the kd-tree instead of using and writing .cg2cache and .cg2tree files in the user cache directory", {"no-cache"});
+    args::ValueFlag<std::string> benchOff(parser, "file", "Time readOff against the ifstream reader and exit", {"bench-off"});
+    args::ValueFlag<std::string> benchObj(parser, "file", "Time readOffobj against the istringstream reader and exit", {"bench-obj"});
 
     // Parse args
     try
@@ -2016,6 +8180,101 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    meshCacheEnabled = !noCache;
+    meshCacheWrite = !noCache;
+    useQuantizedStore = quantized;
+    if (approxNearest)
+        nearestEpsilon = std::max(args::get(approxNearest), 0.0f);
+    if (indexBackend)
+    {
+        if (args::get(indexBackend) == "grid")
+            constraintBackend = IndexBackend::Grid;
+        else if (args::get(indexBackend) == "octree")
+            constraintBackend = IndexBackend::Octree;
+        else if (args::get(indexBackend) == "dynamic")
+            constraintBackend = IndexBackend::Dynamic;
+        else if (args::get(indexBackend) == "chunked")
+            constraintBackend = IndexBackend::Chunked;
+        else if (args::get(indexBackend) != "kdtree")
+        {
+            std::cerr << "--index expects kdtree, grid, octree, dynamic or chunked" << std::endl;
+            return 1;
+        }
+    }
+    if (reorder)
+    {
+        if (args::get(reorder) == "morton")
+            pointOrder = CurveOrder::Morton;
+        else if (args::get(reorder) == "hilbert")
+            pointOrder = CurveOrder::Hilbert;
+        else
+        {
+            std::cerr << "--reorder expects morton or hilbert" << std::endl;
+            return 1;
+        }
+    }
+
+    if (benchOff)
+    {
+        benchReadOff(args::get(benchOff));
+        return 0;
+    }
+    if (benchObj)
+    {
+        benchReadOffobj(args::get(benchObj));
+        return 0;
+    }
+    if (benchChunked)
+    {
+        benchChunkedIndex(args::get(benchChunked));
+        return 0;
+    }
+    if (benchKnn)
+    {
+        benchKNearest(args::get(benchKnn));
+        return 0;
+    }
+    if (benchOctree)
+    {
+        benchOctreeIndex(args::get(benchOctree));
+        return 0;
+    }
+    if (benchSnapshot)
+    {
+        benchTreeSnapshot(args::get(benchSnapshot));
+        return 0;
+    }
+    if (benchDynamic)
+    {
+        benchDynamicIndex(args::get(benchDynamic));
+        return 0;
+    }
+    if (benchApprox)
+    {
+        benchApproxNearest(args::get(benchApprox));
+        return 0;
+    }
+    if (benchBoxes)
+    {
+        benchBoxPruning(args::get(benchBoxes));
+        return 0;
+    }
+    if (benchGrid)
+    {
+        benchGridIndex(args::get(benchGrid));
+        return 0;
+    }
+    if (benchReorder)
+    {
+        benchCurveOrder(args::get(benchReorder));
+        return 0;
+    }
+    if (benchQuantized)
+    {
+        benchQuantizedIndex(args::get(benchQuantized));
+        return 0;
+    }
+
     // Options
     polyscope::options::groundPlaneMode = polyscope::GroundPlaneMode::ShadowOnly;
     polyscope::options::shadowBlurIters = 6;